@@ -0,0 +1,38 @@
+#include <TwoBottle.h>
+
+// — Sketch identifier (will be logged in the CSV) —
+String sketch = "Bandit";
+
+// — Create the TwoBottle object —
+FED3 fed3(sketch);
+
+// — Bandit settings —
+const uint8_t  probLeft    = 80;     // % chance a left poke is rewarded
+const uint8_t  probRight   = 20;     // % chance a right poke is rewarded
+const uint16_t blockLength = 30;     // rewards before the odds swap
+
+void setup() {
+  // fed3.rngSeed = 0x1234ABCD5678EF00;   // uncomment with a logged RandomSeed to replay a session
+  fed3.begin();
+  fed3.disableSleep();
+  fed3.startBandit(probLeft, probRight, blockLength);
+}
+
+void loop() {
+  fed3.run();                        // must be called each loop
+
+  if (fed3.Left) {
+    fed3.logLeftPoke();
+    if (fed3.banditResponse(SIDE_LEFT)) {
+      fed3.ConditionedStimulus();
+      fed3.FeedLeft();
+    }
+  }
+  if (fed3.Right) {
+    fed3.logRightPoke();
+    if (fed3.banditResponse(SIDE_RIGHT)) {
+      fed3.ConditionedStimulus();
+      fed3.FeedRight();
+    }
+  }
+}
@@ -0,0 +1,47 @@
+#include <TwoBottle.h>
+
+// — Sketch identifier (will be logged in the CSV) —
+String sketch = "CuedTrial";
+
+// — Create the TwoBottle object —
+FED3 fed3(sketch);
+
+// — Trial settings —
+const uint32_t responseWindowMs = 5000;   // time the animal has to poke after the cue
+const uint32_t itiMs            = 2000;   // inter-trial interval
+
+// The whole trial reads top to bottom.  Every TB_AWAIT hands control back to loop(), so licks,
+// pokes and logging keep being serviced while the trial waits.
+FED3::Behaviour trial;
+
+void runTrial() {
+  TB_BEGIN(trial);
+  fed3.ConditionedStimulus();                                        // tone + lights
+  TB_AWAIT(trial, fed3.waitPoke(trial, SIDE_LEFT, responseWindowMs));
+  fed3.pixelsOff();
+  if (trial.result) {
+    fed3.logLeftPoke();                                              // correct poke
+    TB_AWAIT(trial, fed3.dispense(trial, SIDE_LEFT));                // drop a left-well pellet
+  }
+  else {
+    fed3.Event = "Omission";                                         // no poke in the window
+    fed3.logdata();
+  }
+  TB_AWAIT(trial, fed3.wait(trial, itiMs));
+  TB_END(trial);
+}
+
+void setup() {
+  fed3.begin();
+  fed3.disableSleep();
+}
+
+void loop() {
+  fed3.run();       // must be called each loop
+  runTrial();       // resumes the trial where it left off
+
+  // pokes on the inactive side are still logged
+  if (fed3.Right) {
+    fed3.logRightPoke();
+  }
+}
@@ -6,16 +6,13 @@ String sketch = "PR1_dual";
 // — Create the TwoBottle object —
 FED3 fed3(sketch);
 
-// — Per‐side counters & current ratio requirements —
-int left_poke_count       = 0;
-int required_left_pokes   = 1;
-int right_poke_count      = 0;
-int required_right_pokes  = 1;
+// — Progressive ratio: +1 per reward on each side (use PR_SERIES_RR for Richardson–Roberts) —
+// A breakpoint is logged per side after fed3.prBreakpointTimeout ms without a poke on it.
 
 void setup() {
   fed3.begin();  
-  // initialize the library’s FR field to match our starting ratio
-  fed3.FR = required_left_pokes; 
+  fed3.startPR(SIDE_LEFT, PR_SERIES_LINEAR);    // requirement starts at 1 and is logged as FR
+  fed3.startPR(SIDE_RIGHT, PR_SERIES_LINEAR);
   fed3.disableSleep(); 
 }
 
@@ -25,19 +22,11 @@ void loop() {
   // — LEFT poke handling —
   if (fed3.Left) {
     fed3.logLeftPoke();  
-    left_poke_count++;
 
-    if (left_poke_count >= required_left_pokes) {
-      // animal has met the current ratio
+    if (fed3.prResponse(SIDE_LEFT)) {
+      // animal has met the current ratio, the requirement has moved to the next one
       fed3.ConditionedStimulus();      // tone + lights
       fed3.FeedLeft();                 // drop a left‐well pellet
-
-      // bump the requirement for the next left‐well pellet
-      required_left_pokes++;
-      fed3.FR = required_left_pokes;   // update the logged FR field
-
-      // reset for next run
-      left_poke_count = 0;
     }
     else {
       fed3.Click();  // feedback click on each sub‐ratio poke
@@ -50,16 +39,10 @@ void loop() {
   // — RIGHT poke handling —
   if (fed3.Right) {
     fed3.logRightPoke();
-    right_poke_count++;
 
-    if (right_poke_count >= required_right_pokes) {
+    if (fed3.prResponse(SIDE_RIGHT)) {
       fed3.ConditionedStimulus();
       fed3.FeedRight();                // drop a right‐well pellet
-
-      required_right_pokes++;
-      fed3.FR = required_right_pokes;  // update FR for logging
-
-      right_poke_count = 0;
     }
     else {
       fed3.Click();
@@ -68,5 +51,5 @@ void loop() {
     fed3.Right = false;
   }
 
-  // — Licks are serviced & logged automatically by serviceLicks() inside fed3.run() :contentReference[oaicite:5]{index=5} :contentReference[oaicite:6]{index=6} —
+  // — Licks are serviced & logged automatically by serviceLicks() inside fed3.run() —
 }
@@ -0,0 +1,35 @@
+#include <TwoBottle.h>
+
+// — Sketch identifier (replaced by the "name" line of SCHEDULE.TXT when one is found) —
+String sketch = "Schedule";
+
+// — Create the TwoBottle object —
+FED3 fed3(sketch);
+
+// Flash this sketch once and change paradigms by editing SCHEDULE.TXT in the root of the
+// microSD card (see the SCHEDULE.TXT next to this sketch).  Without a schedule file the rig
+// falls back to FR1 on the left poke.
+
+void setup() {
+  fed3.begin();
+  fed3.disableSleep();
+}
+
+void loop() {
+  fed3.run();                      // must be called each loop
+
+  if (fed3.scheduleLoaded) {
+    fed3.runSchedule();            // pokes, licks and rewards handled by the schedule table
+    return;
+  }
+
+  // — fallback: FR1 on the left poke —
+  if (fed3.Left) {
+    fed3.logLeftPoke();
+    fed3.ConditionedStimulus();
+    fed3.FeedLeft();
+  }
+  if (fed3.Right) {
+    fed3.logRightPoke();
+  }
+}
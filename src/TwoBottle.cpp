@@ -34,8 +34,33 @@
 #include "TwoBottle.h"
 TwoWire* mprWire = &Wire2;
 #include <core_pins.h>
+
+//  Reset diagnostics live in DMAMEM (RAM2), which the Teensy startup code does not clear,
+//  so they survive a watchdog or software reset and can be written to the log on the next boot
+#define RESET_DIAG_MAGIC 0x46454433  // "FED3"
+struct ResetDiagnostics {
+  uint32_t magic;
+  uint32_t section;                        //last hot-path section entered
+  uint32_t sectionMillis;                  //millis() when that section was entered
+  uint32_t heartbeatMillis[NUM_SECTIONS];  //millis() of the last heartbeat from each subsystem
+  uint32_t heartbeatCount[NUM_SECTIONS];
+  uint32_t loopCount;
+  uint32_t loopMaxMicros;                  //worst time between two run() calls
+  uint32_t loopMeanMicros;                 //running mean (1/16 EMA) of the time between run() calls
+  uint32_t lastGaspMillis;                 //millis() when the watchdog warning interrupt fired
+};
+TB_RAM2 static ResetDiagnostics resetDiag;
+static ResetDiagnostics previousDiag;      //copy of resetDiag taken at boot, before it is cleared
+static const char* const sectionNames[NUM_SECTIONS] = {"Loop", "Licks", "Logging", "Motor", "Display", "Menu", "Error"};
+
+static inline void flushResetDiagnostics() {
+  // RAM2 is write-back cached, push the record out to the RAM itself before a reset
+  arm_dcache_flush(&resetDiag, sizeof(resetDiag));
+}
+
 static inline void teensyReset() {
   // Reset the Teensy microcontroller
+  flushResetDiagnostics();
   SCB_AIRCR = 0x05FA0004; // Write the reset value to the Application Interrupt and Reset Control Register (AIRCR)
   while (1);
 }
@@ -44,19 +69,620 @@ static inline void teensyReset() {
 //  Start FED3 and RTC objects
 FED3 *pointerToFED3;
 
+//  Linker symbols from the Teensy 4 linker scripts, used by printMemoryMap()
+extern "C" {
+  extern unsigned long _stext, _etext, _sdata, _ebss, _estack, _heap_start, _heap_end;
+  extern char *__brkval;
+#if defined(ARDUINO_TEENSY41)
+  extern unsigned long _extram_start, _extram_end;
+#endif
+}
+
+//  Journaled logging: each CSV record is assembled in RAM, then appended to the logfile with a
+//  single write, ending in a per-file sequence number and the CRC32 of everything before it.
+//  recoverLogFile() uses the CRC to find the last complete record after a power loss.
+//  The Event field is capped at LOG_EVENT_MAX and LOG_RECORD_TAIL bytes are always kept for the
+//  sequence number, CRC and line ending, so even an overlong record stays a complete line
+#define LOG_EVENT_MAX 160
+#define LOG_RECORD_TAIL 24                 //",<seq>,<crc>\r\n"
+#define LOG_RECORD_SIZE (384 + (TB_CHANNELS - 2) * 36 + LOG_RECORD_TAIL)
+class LogRecord : public Print {
+  public:
+    char buf[LOG_RECORD_SIZE];
+    size_t len = 0;
+    size_t limit = LOG_RECORD_SIZE - LOG_RECORD_TAIL;
+    bool truncated = false;
+    void clear() {
+      len = 0;
+      limit = sizeof(buf) - LOG_RECORD_TAIL;
+      truncated = false;
+    }
+    void openTail() { limit = sizeof(buf); }
+    size_t write(uint8_t c) {
+      if (len >= limit) {
+        truncated = true;
+        return 0;
+      }
+      buf[len++] = c;
+      return 1;
+    }
+    using Print::write;
+};
+static LogRecord record;                   //hot, stays in DTCM
+
+static uint32_t crc32(const char* data, size_t len) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ (uint8_t)data[i]) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ ((uint8_t)data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+//  Event store for SD outages: records that cannot be written are kept in a byte ring in PSRAM
+//  (EXTMEM) when the Teensy 4.1 has it fitted, otherwise in DMAMEM, and drained to the card once
+//  it comes back.  Records keep their Seq and CRC, so a drain that is retried never goes unnoticed.
+#if defined(ARDUINO_TEENSY41)
+#define PSRAM_STORE_SIZE (4UL * 1024 * 1024)
+TB_EXTMEM static char psramEventStore[PSRAM_STORE_SIZE];
+#endif
+#define DMAMEM_STORE_SIZE (96UL * 1024)
+TB_RAM2 static char dmamemEventStore[DMAMEM_STORE_SIZE];
+static char *eventStore = dmamemEventStore;
+static uint32_t eventStoreSize = DMAMEM_STORE_SIZE;
+static uint32_t storeHead = 0;               //next byte written
+static uint32_t storeTail = 0;               //next byte drained
+static uint32_t storeUsed = 0;
+#define SD_RETRY_MAX 64000UL                 //ms, longest backoff between card restarts
+
+//  Records written since the last successful sync.  SdFat buffers writes, so a failing card
+//  often shows only when the sync fails; the records are then put back into the event store.
+//  Seq and CRC sort out any of them that made it to the card anyway
+#define UNSYNCED_SIZE (8UL * 1024)
+TB_RAM2 static char unsyncedRecords[UNSYNCED_SIZE];
+static uint32_t unsyncedLen = 0;
+static uint32_t unsyncedOverflow = 0;        //records that did not fit, lost if the sync fails
+
+//  Poke edges: both edges of each nose poke are captured by interrupt, confirmed by the
+//  debounce timer, and queued here with their clockMicros() timestamp for run() to process
+struct PokeEvent {
+  uint8_t side;                              //channel
+  bool entry;                                //true when the beam was broken, false when it cleared
+  uint64_t time;                             //clockMicros() of the first edge of the transition
+};
+#define POKE_QUEUE_SIZE 16
+static PokeEvent pokeQueue[POKE_QUEUE_SIZE];
+static volatile uint8_t pokeQueueHead = 0;   //written by the debounce timer
+static volatile uint8_t pokeQueueTail = 0;   //read by run()
+static_assert(TB_CHANNELS >= 2 && TB_CHANNELS <= 12, "TB_CHANNELS must be 2..12, one MPR121 electrode per channel");
+static volatile uint64_t pokeEdgeTime[TB_CHANNELS];    //first edge of a transition that is still bouncing
+static volatile uint32_t pokeLastEdgeMicros[TB_CHANNELS];
+static volatile bool pokeEdgePending[TB_CHANNELS];
+static volatile bool pokeBroken[TB_CHANNELS];          //debounced beam state
+static volatile bool pokeTimerRunning = false;
+
+//  Pulse-train engine for BNC_OUT.  The train is a sequence of high/low segments; each timer
+//  interrupt sets the level for the next segment and re-arms the timer with its length in µs
+#define PULSE_PATTERN_MAX 64
+struct PulseTrain {
+  volatile bool active;
+  bool high;                                 //level of the current segment
+  bool led;                                  //mirror the train on the green LED
+  bool sync;                                 //a sync pulse/barcode: other trains wait until it ends
+  // regular trains
+  uint32_t width;                            //µs high
+  uint32_t period;                           //µs from one rising edge to the next within a burst
+  uint32_t pulses;                           //pulses per burst
+  uint32_t pulsesLeft;
+  uint32_t burstLow;                         //µs low between the last pulse of a burst and the next burst
+  uint32_t bursts;                           //0 repeats the burst until stopPulseTrain()
+  uint32_t burstsLeft;
+  // patterned trains, alternating high/low durations starting with high
+  uint32_t pattern[PULSE_PATTERN_MAX];
+  uint8_t patternLength;                     //0 for regular trains
+  uint8_t patternIndex;
+  uint32_t repeatsLeft;                      //0 repeats until stopPulseTrain()
+  bool repeatForever;
+};
+static PulseTrain pulseTrain;
+
+//  Lick-to-TTL fast path.  The touch status read started by the MPR121 interrupt fires BNC_OUT
+//  from its I2C completion on lick onset for the electrodes in lickTTLMask, without waiting for
+//  run().  The IRQ-to-output latency of every trigger is kept in a 50 µs-bin histogram.
+#define LICK_TTL_BINS 20                     //last bin collects everything >= 950 µs
+struct LickTTLStats {
+  uint32_t count;
+  uint32_t fastCount;                        //triggers fired from the interrupt itself
+  uint32_t blocked;                          //onsets not fired because another train had the line
+  uint32_t minMicros;
+  uint32_t maxMicros;
+  uint64_t sumMicros;
+  uint32_t bins[LICK_TTL_BINS];
+};
+static LickTTLStats lickTTLStats = {0, 0, 0, UINT32_MAX, 0, 0, {0}};
+static volatile uint16_t isrTouched = 0;     //touch status read by the interrupt
+static volatile uint64_t isrTouchedTime = 0; //lick IRQ time of that status
+static volatile bool isrTouchedValid = false;
+static volatile bool mprBusy = false;        //main code holds the MPR121 for blocking Wire calls
+static uint16_t ttlLastTouched = 0;
+
+//  Asynchronous MPR121 reads.  Wire2 is LPI2C4: a register read is queued as LPI2C commands
+//  (START+W, register, repeated START+R, RECEIVE n, STOP) and the LPI2C interrupt refills the
+//  command FIFO, drains the receive FIFO and calls the completion callback once the STOP is on
+//  the bus.  The lick interrupt reads the touch status this way, so no I2C transfer ever
+//  blocks run(); blocking Wire/Adafruit calls take the bus with mprAcquire().  A failed transfer
+//  stays busy until its STOP is on the bus, so the next read cannot flush that STOP from the FIFO
+#define LPI2C_TX_FIFO 4
+#define MPR_I2C_ERRORS (LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF | LPI2C_MSR_PLTF)
+#define MPR_TRANSFER_TIMEOUT 5000            //µs, a 43-byte read takes ~1.1 ms at 400 kHz
+static struct {
+  volatile bool busy;
+  uint32_t start;                            //micros() when the transfer was queued
+  uint8_t *buf;
+  uint8_t len;
+  uint8_t received;
+  uint32_t cmds[5];
+  uint8_t cmdsSent;
+  bool stopping;                             //failed, waiting for the STOP that releases the bus
+  FED3::I2CCallback cb;
+  void *arg;
+} mprAsync;
+static uint8_t touchBuf[2];
+static volatile bool touchReadPending = false;  //lick IRQ that came while the bus was taken
+
+//  Adaptive thresholds.  Per electrode: noise is the running mean of |baseline - filtered|
+//  while released, depth the running mean of the same while touched (both x16 fixed point).
+//  The touch threshold sits above the noise and at a third of the touch depth
+#define THRESHOLD_WARMUP 16                  //released samples before the first adjustment
+#define TOUCH_THRESHOLD_MIN 4
+#define TOUCH_THRESHOLD_MAX 60
+struct ElectrodeTrack {
+  int32_t noise16;
+  int32_t depth16;
+  uint32_t touchedSince;                     //millis() when the current touch began, 0 released
+  uint8_t samples;
+  bool stuck;
+};
+static ElectrodeTrack electrodeTrack[12];
+static uint8_t thresholdBuf[MPR121_RAW_BYTES];
+static volatile bool thresholdReady = false;
+static volatile bool thresholdInFlight = false;
+
+//  Lick bouts, updated once per lick.  Sums instead of sample buffers keep memory fixed
+struct LickBouts {
+  uint64_t lastLick;                         //clockMicros() of the previous lick, 0 none yet
+  uint64_t boutStart;
+  uint32_t current;                          //licks in the open bout
+  uint32_t bouts;
+  uint32_t boutLicks;                        //licks in closed bouts
+  uint64_t boutMicros;                       //summed duration of closed bouts
+  uint64_t iliSum;                           //ms, ILIs within bouts
+  uint32_t iliCount;
+  uint32_t iliBins[ILI_BINS];                //every ILI, bouts or not
+  uint32_t boutILISum;                       //ms, ILIs of the open bout
+  uint32_t boutMinILI;
+};
+static LickBouts lickBouts[TB_CHANNELS];
+
+//  Per-lick times in LICK_LOG_BOUTS mode.  The .LCK file starts with a LickHeader followed by
+//  8-byte LickStamps.  The wall offset slews, so serviceClock() adds a stamp on channel
+//  LICK_OFFSET_CHANNEL each time it updates it, holding the new offset minus the header's
+//  wallOffsetMicros as a signed 48-bit value.  Wall time of a lick is its time plus the header's
+//  offset plus the most recent offset stamp before it
+#define LICK_OFFSET_CHANNEL 0xFF
+#define LICK_BUFFER_STAMPS 64                //one SD sector per write
+#define LICK_PREALLOCATE (8UL * 1024 * 1024) //a million licks
+struct LickStamp {
+  uint32_t micros;                           //clockMicros() of the lick IRQ, low 32 bits
+  uint16_t microsHigh;                       //bits 32..47
+  uint8_t channel;
+  uint8_t check;                             //XOR of the preceding bytes
+};
+static_assert(sizeof(LickStamp) == 8, "LickStamp must stay packed, hosts decode it by offset");
+struct LickHeader {
+  char magic[6];                             //"TBLCK2"
+  uint8_t stampBytes;                        //sizeof(LickStamp)
+  uint8_t channels;                          //TB_CHANNELS
+  uint64_t wallOffsetMicros;
+};
+static LickStamp lickBuffer[LICK_BUFFER_STAMPS];
+static uint8_t lickBuffered = 0;
+static uint8_t lickOffsetsBuffered = 0;      //offset stamps among lickBuffered
+static int64_t lickHeaderOffset = 0;         //wallOffsetMicros in the .LCK header
+
+//  Raw capacitance capture.  Each sample is one burst read of MPR121 registers 0x00..0x2A,
+//  framed for resynchronisation and queued in RAM2 until serviceRawCapture() writes it out.
+//  The .RAW file (or the USB stream) starts with a RawHeader; filtered data are 10-bit
+//  little-endian pairs from register 0x04, baselines one byte each (value >> 2) from 0x1E
+#define RAW_SYNC 0x5AA5
+#define RAW_QUEUE_SIZE 256                   //~0.3 s at 800 Hz, rides out SD write latency
+#define RAW_MIN_INTERVAL 1200                //µs, one 43-byte read takes ~1.1 ms at 400 kHz
+#define RAW_WRITE_SAMPLES 10                 //samples per write, about one SD sector
+#define RAW_PREALLOCATE (64UL * 1024 * 1024) //contiguous file space, no allocation stalls
+#define RAW_TIMER_PRIORITY 112               //GPT1 paces the reads; below the I2C completion (96)
+struct RawSample {
+  uint16_t sync;                             //RAW_SYNC
+  uint16_t seq;                              //wraps; gaps mark dropped samples
+  uint32_t micros;                           //clockMicros() of the read, low 32 bits
+  uint8_t regs[MPR121_RAW_BYTES];
+  uint8_t check;                             //XOR of all preceding bytes
+};
+static_assert(sizeof(RawSample) == 52, "RawSample must stay packed, hosts decode it by offset");
+struct RawHeader {
+  char magic[6];                             //"TBRAW1"
+  uint8_t sampleBytes;                       //sizeof(RawSample)
+  uint8_t regBytes;                          //MPR121_RAW_BYTES
+  uint32_t intervalMicros;
+  uint32_t reserved;
+  uint64_t startWallMicros;                  //wall time of sample 0, µs since 1970
+};
+TB_RAM2 static RawSample rawQueue[RAW_QUEUE_SIZE];
+static volatile uint16_t rawHead = 0;        //advanced by the I2C completion
+static uint16_t rawTail = 0;
+static volatile bool rawInFlight = false;
+static volatile bool rawReadPending = false;  //sample due while the bus was taken
+static uint16_t rawPendingSeq;
+static struct {
+  uint8_t dest;
+  uint32_t interval;
+  uint32_t last;                             //micros() of the last GPT1 tick
+  uint16_t seq;
+} rawCapture;
+
+//  Audio cue sequencer.  Cues are queued by the main code and played back-to-back by the audio
+//  timer, which computes one sample every AUDIO_SAMPLE_MICROS and writes it as the PWM duty on
+//  BUZZER.  Tones and sweeps come from a phase accumulator (DDS), white noise from a xorshift
+//  generator and pink noise from the Voss-McCartney sum of 8 white rows updated at octave rates.
+//  With nothing queued the timer stops, so an idle buzzer costs nothing.  The timer is GPT2, not
+//  an IntervalTimer: the four PIT channels share IRQ_PIT and a single priority, so a 20 kHz
+//  sample interrupt there would add jitter to the TTL, poke and motor timers
+#define AUDIO_SAMPLE_MICROS 50               //20 kHz sample rate
+#define AUDIO_PRIORITY 160                   //below the PIT (128) and the I2C completion (96)
+#define AUDIO_SAMPLE_RATE (1000000 / AUDIO_SAMPLE_MICROS)
+#define AUDIO_PWM_FREQ 146484.375            //8-bit PWM carrier well above hearing
+#define AUDIO_QUEUE_SIZE 16
+struct AudioCue {
+  uint8_t type;
+  uint8_t volume;                            //PWM duty of the loudest sample
+  uint32_t increment;                        //DDS phase step per sample
+  int32_t slope;                             //change of the phase step per sample, for sweeps
+  uint32_t samples;                          //0 plays until stopAudio() or the next cue
+};
+static AudioCue audioQueue[AUDIO_QUEUE_SIZE];
+static volatile uint8_t audioQueueHead = 0;  //written by the main code
+static volatile uint8_t audioQueueTail = 0;  //read by the audio timer
+static volatile bool audioRunning = false;
+static struct {
+  AudioCue cue;                              //cue being played
+  uint32_t phase;
+  uint32_t increment;
+  uint32_t samplesLeft;
+  bool endless;
+  uint32_t noise;                            //xorshift32 state
+  uint32_t pinkCounter;
+  uint8_t pinkRows[8];
+  uint16_t pinkSum;
+} audio = {{0, 0, 0, 0, 0}, 0, 0, 0, false, 2463534242UL, 0, {0}, 0};
+
+//  Stepper engine.  The motor timer advances the 4-wire full-step sequence (the same one the
+//  Stepper library uses) of each moving motor once per tick, so dispenses do not block
+struct MotorMove {
+  volatile bool active;
+  int8_t dir;
+  uint32_t stepsLeft;
+  uint8_t phase;                             //position in the step sequence
+};
+static MotorMove motorMove[TB_CHANNELS];
+static volatile bool motorTimerRunning = false;
+static const uint8_t stepSequence[4] = {0b1010, 0b0110, 0b0101, 0b1001};  //IN1..IN4, MSB first
+
+//  Schedule file, compiled once by loadSchedule() into the table below.  runSchedule() only
+//  compares counters against it; variable schedules draw their next requirement from a table
+//  filled at load time
+#define SCHEDULE_TABLE_SIZE 32
+struct Schedule {
+  uint8_t rule;
+  uint8_t active;                            //bit 0 left, bit 1 right
+  bool cue;                                  //ConditionedStimulus() with each reward
+  uint16_t timeout;                          //s of timeout after each reward
+  uint32_t param;                            //ratio, PR step, interval ms or licks per reward
+  uint8_t series;                            //PR series
+  uint8_t prob[2];                           //bandit: % reward probability per side
+  uint16_t blockLength;                      //bandit: rewards (or trials) before the probabilities swap, 0 never
+  uint8_t switchOn;                          //bandit: BANDIT_SWITCH_REWARDS or BANDIT_SWITCH_TRIALS
+  uint32_t table[SCHEDULE_TABLE_SIZE];       //VR requirements or VI intervals (ms)
+  uint8_t next;                              //next table entry
+  uint32_t requirement;                      //responses (or ms) needed for the next reward
+  uint32_t progress;                         //responses since the last reward
+  unsigned long lastReward;
+};
+static Schedule schedule;
+
+//  Progressive-ratio series, generated at compile time
+#define PR_TABLE_SIZE 40
+struct PRTable {
+  uint32_t ratio[PR_TABLE_SIZE];
+};
+
+constexpr double constexprExp(double x) {
+  double term = 1, sum = 1;
+  for (int n = 1; n < 60; n++) {
+    term *= x / n;
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr PRTable makeRichardsonRoberts() {
+  PRTable t{};
+  for (int j = 1; j <= PR_TABLE_SIZE; j++) t.ratio[j - 1] = (uint32_t)(5 * constexprExp(0.2 * j) - 5 + 0.5);
+  return t;
+}
+
+constexpr PRTable makeDoubling() {
+  PRTable t{};
+  for (int j = 0; j < PR_TABLE_SIZE; j++) t.ratio[j] = (j < 31) ? (1UL << j) : (1UL << 31);
+  return t;
+}
+
+static constexpr PRTable prRichardsonRoberts = makeRichardsonRoberts();
+static constexpr PRTable prDoubling = makeDoubling();
+static_assert(prRichardsonRoberts.ratio[0] == 1 && prRichardsonRoberts.ratio[4] == 9 &&
+              prRichardsonRoberts.ratio[9] == 32 && prRichardsonRoberts.ratio[19] == 268,
+              "Richardson-Roberts series");
+
+struct PRState {
+  bool active;
+  bool broken;                               //breakpoint reached and logged
+  uint8_t series;
+  uint16_t step;                             //increment of PR_SERIES_LINEAR
+  uint16_t index;                            //position in the series
+  uint32_t requirement;                      //responses needed for the current ratio
+  uint32_t progress;                         //responses towards it
+  uint32_t lastCompleted;                    //last ratio the animal completed, 0 if none
+  unsigned long lastResponse;
+};
+static PRState prState[TB_CHANNELS];
+
+static uint64_t rtcMicros();
+static int64_t wallOffsetAt(uint64_t t);
+
+//  PCG32 state (O'Neill, pcg32_random_r)
+static uint64_t pcgState = 0x853c49e6748fea9bULL;
+static const uint64_t pcgIncrement = 0xda3e39cb94b95bdbULL;
+
+//  Task table for the cooperative scheduler.  Tasks run from run() (and from anything that
+//  calls serviceEvents()), one at a time and to completion, so each must return quickly
+#define MAX_TASKS 16
+struct Task {
+  FED3::TaskFunction fn;                     //nullptr marks a free slot
+  void *arg;
+  const char *name;
+  uint32_t period;                           //ms, 0 for one-shot tasks
+  unsigned long due;                         //millis() of the next run
+  uint32_t runs;
+  uint32_t maxMicros;                        //longest run
+  uint64_t totalMicros;
+  uint32_t maxLateMillis;                    //worst delay past the due time
+};
+static Task tasks[MAX_TASKS];
+static bool tasksRunning = false;            //a task is running, do not re-enter
+
+//  NeoPixel effect in progress, advanced by serviceLEDs()
+struct LEDEffect {
+  uint8_t type;
+  uint32_t color;
+  uint16_t onMs;                             //wipe: ms per pixel; blink: ms on; cue: unused
+  uint16_t offMs;                            //blink: ms off
+  uint32_t stepsLeft;                        //wipe: pixels; blink: on/off phases; cue: 1
+  uint8_t index;                             //wipe: next pixel
+  unsigned long next;                        //millis() of the next step
+};
+static LEDEffect ledEffect = {LED_EFFECT_NONE, 0, 0, 0, 0, 0, 0};
+
+//  BNC input capture: in BNC_MODE_INPUT every edge on the BNC line is queued with its clockMicros()
+//  timestamp by the pin interrupt and logged by serviceEvents() as BNCRise/BNCFall
+struct BNCEdge {
+  bool rising;
+  uint64_t time;
+};
+#define BNC_QUEUE_SIZE 64
+static BNCEdge bncQueue[BNC_QUEUE_SIZE];
+static volatile uint8_t bncQueueHead = 0;
+static volatile uint8_t bncQueueTail = 0;
+
+//  Timebase.  clockMicros() extends the 32-bit cycle counter (wraps every ~7 s at 600 MHz) to
+//  64 bits; the millis() tick between two reads says how many wraps were missed, so the clock
+//  stays monotonic however rarely it is read.  Wall time is the clock plus an offset that
+//  serviceClock() keeps in step with the RTC.  A slew runs the offset at slewPpm from slewStart
+//  until slewRemaining has been applied; |slewPpm| stays far below 1e6, so slewed wall time
+//  never runs backwards.
+static uint64_t clockCycles = 0;             //extended cycle count at the last read
+static uint32_t clockLastCycles = 0;         //ARM_DWT_CYCCNT at the last read
+static uint32_t clockLastMillis = 0;         //millis() at the last read
+static int64_t wallOffsetMicros = 0;         //wall time (µs since 1970) minus clockMicros(), at slewStart
+static uint64_t slewStart = 0;               //clockMicros() the current slew started at
+static int32_t slewPpm = 0;                  //µs of correction per second of clock
+static int64_t slewRemaining = 0;            //correction the current slew still applies, µs
+#define CLOCK_STEP_MICROS 100000             //errors above this step the wall clock, smaller ones are slewed
+#define CLOCK_SLEW_PPM 500                   //fastest slew, 0.05%
+
+//Close a record: ",<seq>,<CRC32 of everything up to and including that comma>\r\n"
+static void sealRecord(LogRecord &r, uint32_t seq) {
+  r.openTail();
+  r.print(seq);
+  r.print(",");
+  char crcText[12];
+  snprintf(crcText, sizeof(crcText), "%08lX\r\n", (unsigned long)crc32(r.buf, r.len));
+  r.print(crcText);
+}
+
+//A journaled record ends in ",<8 hex digit CRC32 of everything before the digits>"
+static bool recordValid(const char* line, size_t len) {
+  while (len > 0 && line[len - 1] == '\r') len--;
+  if (len < 10 || line[len - 9] != ',') return false;
+  uint32_t stored = 0;
+  for (size_t i = len - 8; i < len; i++) {
+    char c = line[i];
+    stored <<= 4;
+    if (c >= '0' && c <= '9') stored |= c - '0';
+    else if (c >= 'A' && c <= 'F') stored |= c - 'A' + 10;
+    else return false;
+  }
+  return crc32(line, len - 8) == stored;
+}
+
+//Seal a dummy record and check it the way recoverLogFile() does.  If the two ever disagree,
+//recovery must not cut files back to records it cannot read
+static bool journalSelfTest() {
+  static LogRecord r;
+  r.clear();
+  r.print("1/1/2025 0:00:00:000,SelfTest,");
+  sealRecord(r, 1);
+  return r.len > 1 && recordValid(r.buf, r.len - 1);   //without the '\n', as recovery reads lines
+}
+
 
 //  Interrupt handlers
 
-static void outsideLeftTriggerHandler(void) {
-  pointerToFED3->leftTrigger();
+//attachInterrupt() passes no argument, so each channel gets its own poke handler
+template <uint8_t CH>
+FASTRUN static void outsidePokeHandler(void) {
+  pointerToFED3->pokeEdge(CH);
+}
+
+template <uint8_t CH>
+static void attachPokeHandlers(FED3 *fed) {
+  attachInterrupt(digitalPinToInterrupt(fed->channel[CH].pins.poke), outsidePokeHandler<CH>, CHANGE);
+  if constexpr (CH + 1 < TB_CHANNELS) attachPokeHandlers<CH + 1>(fed);
+}
+
+FASTRUN static void outsidePulseTrainHandler(void) {
+  pointerToFED3->pulseTrainTick();
+}
+
+FASTRUN static void outsideBNCHandler(void) {
+  pointerToFED3->bncEdge();
+}
+
+FASTRUN static void outsidePokeDebounceHandler(void) {
+  pointerToFED3->pokeDebounce();
+}
+
+FASTRUN static void outsideAudioHandler(void) {
+  GPT2_SR = GPT_SR_OF1;
+  pointerToFED3->audioTick();
+  asm volatile("dsb");                   //the flag must be clear before the return
+}
+
+//GPT2 interrupt every AUDIO_SAMPLE_MICROS, counting the 24 MHz crystal
+static void audioTimerBegin() {
+  CCM_CCGR0 |= CCM_CCGR0_GPT2_BUS(CCM_CCGR_ON) | CCM_CCGR0_GPT2_SERIAL(CCM_CCGR_ON);
+  GPT2_CR = 0;
+  GPT2_PR = GPT_PR_PRESCALER24M(0);
+  GPT2_SR = 0x3F;
+  GPT2_OCR1 = 24 * AUDIO_SAMPLE_MICROS - 1;
+  GPT2_IR = GPT_IR_OF1IE;
+  attachInterruptVector(IRQ_GPT2, outsideAudioHandler);
+  NVIC_SET_PRIORITY(IRQ_GPT2, AUDIO_PRIORITY);
+  NVIC_ENABLE_IRQ(IRQ_GPT2);
+  GPT2_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_EN;   //restart mode: compare 1 resets the count
+}
+
+static void audioTimerEnd() {
+  GPT2_CR = 0;
+  NVIC_DISABLE_IRQ(IRQ_GPT2);
+}
+
+FASTRUN static void outsideMotorHandler(void) {
+  pointerToFED3->motorTick();
+}
+
+FASTRUN static void outsideLickIRQ(void) {
+  pointerToFED3->lickInterrupt();
+}
+
+//Queue commands while the LPI2C transmit FIFO has room
+FASTRUN static void mprFeed(void) {
+  while (mprAsync.cmdsSent < 5 && LPI2C_MFSR_TXCOUNT(LPI2C4_MFSR) < LPI2C_TX_FIFO) {
+    LPI2C4_MTDR = mprAsync.cmds[mprAsync.cmdsSent++];
+  }
+  if (mprAsync.cmdsSent == 5) LPI2C4_MIER &= ~LPI2C_MIER_TDIE;
+}
+
+FASTRUN static void touchReadDone(void *arg, bool ok);
+FASTRUN static void rawStartRead();
+
+FASTRUN static void mprFinish(bool ok) {
+  LPI2C4_MIER = 0;
+  mprAsync.stopping = false;
+  mprAsync.busy = false;
+  if (!ok) pointerToFED3->mprReadErrors++;
+  mprAsync.cb(mprAsync.arg, ok);
+  if (touchReadPending && !mprBusy && pointerToFED3->mprReadAsync(0x00, touchBuf, 2, touchReadDone, pointerToFED3)) {
+    touchReadPending = false;
+  }
+  if (rawReadPending && !mprBusy && !mprAsync.busy) rawStartRead();
+}
+
+FASTRUN static void outsideMprI2CHandler(void) {
+  uint32_t msr = LPI2C4_MSR;
+  if (mprAsync.stopping) {
+    if ((msr & (LPI2C_MSR_SDF | MPR_I2C_ERRORS)) || !(msr & LPI2C_MSR_MBF)) {
+      LPI2C4_MSR = msr & (LPI2C_MSR_SDF | MPR_I2C_ERRORS);
+      mprFinish(false);
+    }
+    return;
+  }
+  if (msr & MPR_I2C_ERRORS) {
+    LPI2C4_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;   //drop what is left of the transfer
+    LPI2C4_MSR = (msr & MPR_I2C_ERRORS) | LPI2C_MSR_SDF;
+    LPI2C4_MTDR = LPI2C_MTDR_CMD_STOP;             //release the bus
+    if (!(LPI2C4_MSR & LPI2C_MSR_MBF)) {           //lost arbitration or already idle: no STOP to wait for
+      mprFinish(false);
+      return;
+    }
+    mprAsync.stopping = true;                      //finish on SDF; serviceMprBus() times it out
+    LPI2C4_MIER = LPI2C_MIER_SDIE | LPI2C_MIER_NDIE | LPI2C_MIER_ALIE | LPI2C_MIER_FEIE;
+    return;
+  }
+  uint32_t data;
+  while (!((data = LPI2C4_MRDR) & LPI2C_MRDR_RXEMPTY)) {
+    if (mprAsync.received < mprAsync.len) mprAsync.buf[mprAsync.received++] = data;
+  }
+  mprFeed();
+  if ((msr & LPI2C_MSR_SDF) && mprAsync.cmdsSent == 5) {
+    LPI2C4_MSR = LPI2C_MSR_SDF;
+    mprFinish(mprAsync.received == mprAsync.len);
+  }
+}
+
+FASTRUN static void thresholdReadDone(void *arg, bool ok) {
+  thresholdReady = ok;
+  thresholdInFlight = false;
 }
 
-static void outsideRightTriggerHandler(void) {
-  pointerToFED3->rightTrigger();
+//Touch status read started by the lick interrupt: fire the lick TTL and hand the status to run()
+FASTRUN static void touchReadDone(void *arg, bool ok) {
+  FED3 *fed = static_cast<FED3*>(arg);
+  if (ok) {
+    uint16_t touched = (touchBuf[0] | (touchBuf[1] << 8)) & 0x0FFF;
+    isrTouched = touched;
+    isrTouchedTime = fed->lickIRQTime;
+    isrTouchedValid = true;
+    if (fed->lickTTL(touched, fed->lickIRQTime)) lickTTLStats.fastCount++;
+  }
+  fed->lickIRQ = true;
 }
 
-static void outsideLickIRQ(void) {
-  pointerToFED3->lickIRQ = true; // Set the lick interrupt flag
+// Fires 0.5 s before the watchdog resets the Teensy: last chance to save the diagnostics
+FASTRUN static void watchdogWarningISR(void) {
+  WDOG1_WICR |= (1 << 14);               // clear WTIS
+  resetDiag.lastGaspMillis = millis();
+  flushResetDiagnostics();
 }
 
 /**************************************************************************************************************************************************
@@ -64,81 +690,262 @@ static void outsideLickIRQ(void) {
 **************************************************************************************************************************************************/
 void FED3::run() {
   //This should be called at least once per loop.  It updates the time, updates display, and controls sleep 
-  if (lickIRQ) serviceLicks();
-  if (leftHeld  && digitalRead(LEFT_POKE)  == HIGH) leftHeld  = false;
-  if (rightHeld && digitalRead(RIGHT_POKE) == HIGH) rightHeld = false;
+  unsigned long runMicros = micros();
+  if (lastRunMicros != 0) {
+    uint32_t loopMicros = runMicros - lastRunMicros;
+    if (loopMicros > resetDiag.loopMaxMicros) resetDiag.loopMaxMicros = loopMicros;
+    resetDiag.loopMeanMicros += ((int32_t)loopMicros - (int32_t)resetDiag.loopMeanMicros) / 16;
+  }
+  lastRunMicros = runMicros;
+  resetDiag.loopCount++;
+  enterSection(SECTION_LOOP);
+  if (resetDiag.loopCount == 1) {       //the startup menus are over, start watching the subsystems
+    watchHeartbeat(SECTION_LOGGING, 5000);
+    watchHeartbeat(SECTION_MOTOR, 10000);
+  }
+  bool motorsIdle = true;
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) motorsIdle &= !motorBusy(ch);
+  if (motorsIdle) heartbeat(SECTION_MOTOR);  //a turn that never ends goes stale
+  watchdogService();
+
+  serviceEvents();
   time_t nowTime = now();
   currentHour = hour(nowTime); //useful for timed feeding sessions
   currentMinute = minute(nowTime); //useful for timed feeding sessions
   currentSecond = second(nowTime); //useful for timed feeding sessions
   unixtime = nowTime;
-  ReadBatteryLevel();
-  UpdateDisplay();
   goToSleep();
 }
 
+//  The green LED flashes twice for every logged record.  The flashes are stepped from the
+//  service loop rather than with delay(), and give way to a pulse train mirrored on the LED
+#define LOG_BLINK_MS 25
+static uint8_t logBlinkSteps = 0;            //LED changes left, odd ones switch it on
+static uint32_t logBlinkNext = 0;
+
+static void serviceLogBlink() {
+  if (logBlinkSteps == 0 || (long)(millis() - logBlinkNext) < 0) return;
+  logBlinkSteps--;
+  logBlinkNext += LOG_BLINK_MS;
+  if (pulseTrain.active && pulseTrain.led) return;
+  digitalWriteFast(GREEN_LED, (logBlinkSteps & 1) ? HIGH : LOW);
+}
+
+//Background services that must keep running even while a sketch waits, e.g. during Timeout()
+void FED3::serviceEvents() {
+  serviceMprBus();
+  if (lickIRQ) serviceLicks();
+  servicePokes();
+  serviceTimeout();
+  serviceBNC();
+  serviceSync();
+  serviceLEDs();
+  servicePR();
+  serviceClock();
+  if (rawCaptureActive) serviceRawCapture();
+  serviceLogBlink();
+  runTasks();
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Task scheduler
+**************************************************************************************************************************************************/
+//Run fn every periodMs, first after one period.  Returns the task id, or -1 if the table is full
+int8_t FED3::every(uint32_t periodMs, TaskFunction fn, void *arg, const char *name) {
+  for (int8_t id = 0; id < MAX_TASKS; id++) {
+    if (tasks[id].fn != nullptr) continue;
+    tasks[id] = {fn, arg, name, periodMs, millis() + periodMs, 0, 0, 0, 0};
+    return id;
+  }
+  return -1;
+}
+
+//Run fn once, delayMs from now
+int8_t FED3::after(uint32_t delayMs, TaskFunction fn, void *arg, const char *name) {
+  int8_t id = every(delayMs, fn, arg, name);
+  if (id >= 0) tasks[id].period = 0;
+  return id;
+}
+
+//Run fn once at the next pass, e.g. to move work out of a poke handler
+int8_t FED3::defer(TaskFunction fn, void *arg, const char *name) {
+  return after(0, fn, arg, name);
+}
+
+void FED3::cancelTask(int8_t id) {
+  if (id >= 0 && id < MAX_TASKS) tasks[id].fn = nullptr;
+}
+
+void FED3::setTaskPeriod(int8_t id, uint32_t periodMs) {
+  if (id < 0 || id >= MAX_TASKS || tasks[id].fn == nullptr) return;
+  tasks[id].period = periodMs;
+  tasks[id].due = millis() + periodMs;
+}
+
+//Run every task that is due, once each
+void FED3::runTasks() {
+  if (tasksRunning) return;
+  tasksRunning = true;
+  for (int8_t id = 0; id < MAX_TASKS; id++) {
+    Task &t = tasks[id];
+    if (t.fn == nullptr || (long)(millis() - t.due) < 0) continue;
+    uint32_t late = millis() - t.due;
+    if (late > t.maxLateMillis) t.maxLateMillis = late;
+    TaskFunction fn = t.fn;
+    if (t.period == 0) t.fn = nullptr;                       //one-shot: free the slot before it runs
+    else t.due += (late < t.period) ? t.period : late + t.period;  //skip missed periods
+    uint32_t start = micros();
+    fn(t.arg);
+    uint32_t took = micros() - start;
+    t.runs++;
+    t.totalMicros += took;
+    if (took > t.maxMicros) t.maxMicros = took;
+  }
+  tasksRunning = false;
+}
+
+//Built-in periodic work: refreshing the screen, sampling the battery and the AHT20 and syncing
+//the logfile.  Use setTaskPeriod() with the task ids to change the rates
+void FED3::startTasks() {
+  if constexpr (TBConfig::display) displayTask = every(1000, [](void *fed) { static_cast<FED3*>(fed)->UpdateDisplay(); }, this, "display");
+  batteryTask = every(10000, [](void *fed) { static_cast<FED3*>(fed)->ReadBatteryLevel(); }, this, "battery");
+  if (TBConfig::aht20 && tempSensor) {
+    environmentTask = every(5000, [](void *fed) { static_cast<FED3*>(fed)->readEnvironment(); }, this, "environment");
+  }
+  if (boutSummaryInterval > 0) {
+    boutTask = every(boutSummaryInterval, [](void *fed) { static_cast<FED3*>(fed)->writeBoutSummary(); }, this, "bouts");
+  }
+  logTask = every(50, [](void *fed) {
+    FED3 *f = static_cast<FED3*>(fed);
+    f->heartbeat(SECTION_LOGGING);
+    if (f->logDirty && (millis() - f->lastLogSync >= f->logSyncInterval)) f->syncLog();
+    if (f->eventStoreRecords > 0 && (millis() - f->lastSDRetry >= f->sdRetryDelay)) f->drainEventStore();
+  }, this, "log");
+}
+
+//Per-task timing as CSV, plus the run() loop latency
+void FED3::printTaskStats(Print &out) {
+  out.println(F("Task,Runs,Mean us,Max us,Max late ms"));
+  for (int8_t id = 0; id < MAX_TASKS; id++) {
+    Task &t = tasks[id];
+    if (t.fn == nullptr) continue;
+    out.print(t.name); out.print(",");
+    out.print(t.runs); out.print(",");
+    out.print(t.runs ? (uint32_t)(t.totalMicros / t.runs) : 0); out.print(",");
+    out.print(t.maxMicros); out.print(",");
+    out.println(t.maxLateMillis);
+  }
+  out.print(F("Loop mean/max us,")); out.print(resetDiag.loopMeanMicros);
+  out.print(","); out.println(resetDiag.loopMaxMicros);
+}
+
 /**************************************************************************************************************************************************
                                                                                                 Poke functions
 **************************************************************************************************************************************************/
-//log left poke
-void FED3::logLeftPoke(){
-    Left = false;
-    Serial.println(">>> [FED3] logLeftPoke() start");
-    leftPokeTime = millis();
-    LeftCount ++;
-    leftInterval = 0.0;
-    if (digitalRead(LEFT_POKE) == LOW) return;  //Hang here until poke is clear
-    leftInterval = (millis()-leftPokeTime);
+//log a poke.  The row is written when the beam clears so Poke_Time holds the real duration
+void FED3::logPoke(uint8_t ch){
+    if (ch >= TB_CHANNELS) return;
+    Channel &c = channel[ch];
+    c.poked = false;
+    c.pokes ++;
+    if (c.held) {
+      c.logPending = true;   //servicePokes() finishes this when the exit edge arrives
+      return;
+    }
+    finishPoke(ch);
+}
+
+void FED3::finishPoke(uint8_t ch){
+    Channel &c = channel[ch];
+    c.logPending = false;
     UpdateDisplay();
-    DisplayLeftInt();
-    if (leftInterval < minPokeTime) {
-      Event = "LeftShort";
+    if (ch == SIDE_LEFT) DisplayLeftInt();
+    else if (ch == SIDE_RIGHT) DisplayRightInt();
+    if (c.interval < minPokeTime) {
+      Event = String(c.name) + "Short";
     }
     else{
-      Event = "LeftPoke";
+      Event = String(c.name) + "Poke";
     }
 
+    eventTime = c.pokeTime;   //the row is written on exit but stamped with the entry
     logdata();
-    LeftDropAvailable = false; //reset left drop
+    c.dropAvailable = false; //reset the drop
+}
+
+void FED3::logLeftPoke(){
+    logPoke(SIDE_LEFT);
+}
+
+//Channel whose poke the current Event describes, or -1
+int8_t FED3::pokeEventChannel(){
+    const char *event = Event.c_str();
+    for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+      size_t n = strlen(channel[ch].name);
+      if (strncmp(event, channel[ch].name, n) != 0) continue;
+      const char *kind = event + n;
+      if (!strcmp(kind, "Poke") || !strcmp(kind, "Short") || !strcmp(kind, "inTimeout")) return ch;
+    }
+    return -1;
 }
 
-//log right poke
 void FED3::logRightPoke(){
-    Right = false; 
-    rightPokeTime = millis();
-    RightCount ++;
-    rightInterval = 0.0;
-    if (digitalRead (RIGHT_POKE) == LOW) return;  //Hang here until poke is clear
-    rightInterval = (millis()-rightPokeTime);
-    UpdateDisplay();
-    DisplayRightInt();
-    if (rightInterval < minPokeTime) {
-      Event = "RightShort";
+    logPoke(SIDE_RIGHT);
+}
+
+//Process the debounced poke edges queued by the interrupts
+void FED3::servicePokes(){
+  while (pokeQueueTail != pokeQueueHead) {
+    PokeEvent e = pokeQueue[pokeQueueTail];
+    pokeQueueTail = (pokeQueueTail + 1) % POKE_QUEUE_SIZE;
+    Channel &c = channel[e.side];
+    if (e.entry) {
+      c.pokeTime = e.time;
+      c.interval = 0;
+      c.intervalMicros = 0;
+      c.held = true;
+      if (timeoutActive) timeoutPoke(e.side);
+      else c.poked = true;
     }
-    else{
-      Event = "RightPoke";
+    else if (c.held) {
+      c.intervalMicros = e.time - c.pokeTime;
+      c.interval = c.intervalMicros / 1000;
+      c.held = false;
+      if (c.inTimeout) {
+        c.inTimeout = false;
+        UpdateDisplay();
+        Event = String(c.name) + "inTimeout";
+        eventTime = c.pokeTime;
+        logdata();
+      }
+      else if (c.logPending) finishPoke(e.side);
     }
-
-    logdata();
-    RightDropAvailable = false; //reset right drop
+  }
 }
 
-void FED3::logLeftLick(){
-  Event = "LeftLick";
+void FED3::logLick(uint8_t ch){
+  if (ch >= TB_CHANNELS) return;
+  Event = String(channel[ch].name) + "Lick";
   UpdateDisplay();
+  if (lickLogMode == LICK_LOG_BOUTS) {
+    eventTime = 0;                      //the bout row and the .LCK file carry this lick
+    return;
+  }
   logdata();
 }
 
+void FED3::logLeftLick(){
+  logLick(SIDE_LEFT);
+}
+
 void FED3::logRightLick(){
-  Event = "RightLick";
-  UpdateDisplay();
-  logdata();
+  logLick(SIDE_RIGHT);
 }
 
 void FED3::randomizeActivePoke(int max){
   //Store last active side and randomize
   byte lastActive = activePoke;
-  activePoke = random (0, 2);
+  activePoke = randomNumber(2);
 
   //Increment consecutive active pokes, or reset consecutive to zero
   if (activePoke == lastActive) {
@@ -164,14 +971,11 @@ void FED3::randomizeActivePoke(int max){
                                                                                                 Feeding functions
 **************************************************************************************************************************************************/
 
-void FED3::FeedLeft(int steps,int pulse, bool pixelsoff) {
-  if (steps == 0) steps = doseLeftSteps;
-  numMotorTurnsLeft = 0;
-  //Run this loop repeatedly until statement below is false
-  bool pelletDispensed = false;
-  if (pelletDispensed == false) {
-    pelletDispensed = RotateDiskLeft(steps);
-  }
+void FED3::Feed(uint8_t ch, int steps, int pulse, bool pixelsoff) {
+  if (ch >= TB_CHANNELS) return;
+  if (steps == 0) steps = channel[ch].doseSteps;
+  channel[ch].motorTurns = 0;
+  bool pelletDispensed = RotateDisk(ch, steps);
 
   if (pixelsoff==true){
     pixelsOff();
@@ -180,57 +984,40 @@ void FED3::FeedLeft(int steps,int pulse, bool pixelsoff) {
     //If pellet is detected during or after this motion
   if (pelletDispensed == true) {
     // Immediately finish dispense and return to the loop
-    ReleaseMotor();
-    LeftDropTime = millis();
-    retInterval = (millis() - LeftDropTime);
-    LeftDeliverCount++;
-    TotalDeliverCount++;
-    if (pulse > 0){
-      BNC (pulse, 1);  
-    }
-    Event = "LeftDeliver";
-    
-    LeftDropAvailable = true;
-    UpdateDisplay();
-    logdata();
-    return;
+    finishFeed(ch, pulse);
   }
 }
 
+void FED3::FeedLeft(int steps,int pulse, bool pixelsoff) {
+  Feed(SIDE_LEFT, steps, pulse, pixelsoff);
+}
+
 void FED3::FeedRight(int steps,int pulse, bool pixelsoff) {
-  if (steps == 0) steps = doseRightSteps;
-  numMotorTurnsRight = 0;
-  //Run this loop repeatedly until statement below is false
-  bool pelletDispensed = false;
-  if (pelletDispensed == false) {
-	    pelletDispensed = RotateDiskRight(steps);
-  }
+  Feed(SIDE_RIGHT, steps, pulse, pixelsoff);
+}
 
-  if (pixelsoff==true){
-    pixelsOff();
-  }
-    //If pellet is detected during or after this motion
-  if (pelletDispensed == true) {    
-    ReleaseMotor ();
-    RightDropTime = millis();   
-    retInterval = (millis() - RightDropTime);
-    RightDeliverCount++;
-    TotalDeliverCount++;
-      // If pulse duration is specified, send pulse from BNC port
-    if (pulse > 0){
-      BNC (pulse, 1);  
-    }
-    Event = "RightDeliver";
-
-      //calculate InterPelletInterval
-    time_t nowTime = now();
-    interPelletInterval = nowTime - lastPellet;  //calculate time in seconds since last pellet logged
-    lastPellet  = nowTime;
-    UpdateDisplay();
-    logdata();
-    RightDropAvailable = true;
-    return;
+//Count, signal and log a completed dispense
+void FED3::finishFeed(uint8_t side, int pulse) {
+  ReleaseMotor ();
+  Channel &c = channel[side];
+  c.dropTime = millis();
+  retInterval = (millis() - c.dropTime);
+  c.delivers++;
+  TotalDeliverCount++;
+    // If pulse duration is specified, send pulse from BNC port
+  if (pulse > 0){
+    BNC (pulse, 1);  
   }
+  Event = String(c.name) + "Deliver";
+
+    //calculate InterPelletInterval
+  uint64_t pelletTime = clockMicros();
+  interPelletInterval = (pelletTime - lastPellet) / 1000000.0;  //seconds since last pellet logged
+  lastPellet = pelletTime;
+
+  c.dropAvailable = true;
+  UpdateDisplay();
+  logdata();
 }
 
 //////////////////////////
@@ -293,280 +1080,1756 @@ bool FED3::ClearJam() {
 	return false;
 }
 */
-bool FED3::RotateDiskLeft(int steps) {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);  //Enable left motor driver 
-  stepperLeft.setSpeed(dispenseRPM);   // adjust to taste  
-  int dir = (steps >= 0) ? 1 : -1; // determine direction based on sign of steps
-  steps = abs(steps);
-  stepperLeft.step(dir*steps); 
+//Turn the disk and wait for it.  Licks, pokes and logging keep being serviced while it turns
+bool FED3::RotateDisk(uint8_t ch, int steps) {
+  if (ch >= TB_CHANNELS) return false;
+  uint8_t section = enterSection(SECTION_MOTOR);
+  while (!startRotate(ch, steps)) serviceEvents();
+  while (motorBusy(ch)) serviceEvents();
 	ReleaseMotor ();
-  Serial.println("RotateDiskLeft done");
+  heartbeat(SECTION_MOTOR);
+  enterSection(section);
 	return true;
 }
 
+bool FED3::RotateDiskLeft(int steps) {
+  return RotateDisk(SIDE_LEFT, steps);
+}
+
 bool FED3::RotateDiskRight(int steps) {
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);  //Enable right motor driver
-  stepperRight.setSpeed(dispenseRPM);   // adjust to taste
-  int dir = (steps >= 0) ? 1 : -1; // determine direction based on sign of steps
-  steps = abs(steps);
-  stepperRight.step(dir*steps);
-	ReleaseMotor ();
-	return true;
+  return RotateDisk(SIDE_RIGHT, steps);
 }
 
-//helper function for lick sensor
-void FED3::serviceLicks(){
-  static uint16_t lastLick = 0; //last time a lick was detected
-  uint16_t currentLick = cap.touched(); //current time
-  uint16_t rise = currentLick & ~lastLick; //current time in ms
-  if (rise & (1 << LEFT_LICK)) { //if left lick is detected
-    LeftLickCount++;
-    lickLeftFlag = true; //set left lick flag
-    LeftDropAvailable = false; //reset left pellet well
-    logLeftLick();
-  }
-  if (rise & (1 << RIGHT_LICK)) { //if right lick is detected
-    RightLickCount++;
-    lickRightFlag = true; //set right lick flag
-    RightDropAvailable = false; //reset right pellet well
-    logRightLick();
+//Start turning a disk and return immediately; the motor timer steps it at dispenseRPM.
+//Returns false if that motor is already moving
+bool FED3::startRotate(uint8_t side, int steps) {
+  if (side >= TB_CHANNELS || motorBusy(side)) return false;
+  claimDriverPower(channel[side].pins.driver, POWER_MOTOR);  //Enable motor driver
+  MotorMove &m = motorMove[side];
+  m.dir = (steps >= 0) ? 1 : -1; // determine direction based on sign of steps
+  m.stepsLeft = abs(steps);
+  if (m.stepsLeft == 0) return true;
+  noInterrupts();
+  m.active = true;
+  if (!motorTimerRunning) {
+    motorTimerRunning = true;
+    uint32_t stepMicros = 60000000UL / STEPS / max(dispenseRPM, 1);  // same step delay as Stepper::setSpeed()
+    motorTimer.begin(outsideMotorHandler, stepMicros);
   }
-  lastLick = currentLick; //update last lick time
-  cap.touched(); //clear the interrupt flag
-  lickIRQ = false; //reset lick interrupt flag
+  interrupts();
+  return true;
 }
 
-//Function for delaying between motor movements, but also ending this delay if a pellet is detected
-bool FED3::dispenseTimer_ms(int ms) {
-  for (int i = 1; i < ms; i++) {
-    for (int j = 0; j < 10; j++) {
-  	  delayMicroseconds(100);		
-	}
+bool FED3::motorBusy(uint8_t side) {
+  return side < TB_CHANNELS && motorMove[side].active;
+}
+
+//Motor timer: one full step on every moving motor
+void FED3::motorTick() {
+  bool moving = false;
+  for (uint8_t side = 0; side < TB_CHANNELS; side++) {
+    MotorMove &m = motorMove[side];
+    if (!m.active) continue;
+    m.phase = (m.phase + m.dir) & 3;
+    uint8_t bits = stepSequence[m.phase];
+    const uint8_t *pins = channel[side].pins.motor;
+    for (uint8_t i = 0; i < 4; i++) digitalWriteFast(pins[i], (bits >> (3 - i)) & 1);
+    if (--m.stepsLeft == 0) m.active = false;
+    else moving = true;
+  }
+  if (!moving) {
+    motorTimer.end();
+    motorTimerRunning = false;
   }
-  return false;
 }
 
-//Timeout function
+/**************************************************************************************************************************************************
+                                                                                                   Adaptive lick thresholds
+**************************************************************************************************************************************************/
+//Retune the touch/release thresholds of the channel electrodes every periodMs from their
+//measured noise and touch depth.  Changes are logged as Threshold events
+void FED3::startAdaptiveThresholds(uint32_t periodMs) {
+  stopAdaptiveThresholds();
+  memset(electrodeTrack, 0, sizeof(electrodeTrack));
+  thresholdReady = false;
+  thresholdTask = every(periodMs, [](void *fed) { static_cast<FED3*>(fed)->serviceThresholds(); }, this, "thresholds");
+}
 
-void FED3::Timeout(int seconds, bool reset, bool whitenoise) {
-  int timeoutStart = millis();
+void FED3::stopAdaptiveThresholds() {
+  cancelTask(thresholdTask);
+  thresholdTask = -1;
+}
 
-  while ((millis() - timeoutStart) < (static_cast<unsigned long>(seconds)*1000UL)) {
-    if (whitenoise) {
-      int freq = random(50,250);
-      tone(BUZZER, freq, 10);
-      delay (10);
-    }
+//Use the last sample, then start the next one.  The read is async, so logging never waits on it
+void FED3::serviceThresholds() {
+  if (thresholdReady) {
+    thresholdReady = false;
+    adaptThresholds();
+  }
+  if (thresholdInFlight) return;
+  thresholdInFlight = true;
+  if (!mprReadAsync(0x00, thresholdBuf, MPR121_RAW_BYTES, thresholdReadDone, nullptr)) thresholdInFlight = false;
+}
 
-    if (digitalRead(LEFT_POKE) == LOW) {             //If left poke is triggered
-      if (reset) {
-        timeoutStart = millis();
-      }
-      leftPokeTime = millis();
-      if (countAllPokes) {
-        LeftCount ++;
+void FED3::adaptThresholds() {
+  uint16_t touched = (thresholdBuf[0] | (thresholdBuf[1] << 8)) & 0x0FFF;
+  char msg[72];
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    uint8_t e = channel[ch].pins.electrode;
+    if (e >= 12) continue;
+    ElectrodeTrack &t = electrodeTrack[e];
+    uint16_t filtered = (thresholdBuf[MPR121_FILTDATA_0L + 2 * e] | (thresholdBuf[MPR121_FILTDATA_0L + 2 * e + 1] << 8)) & 0x3FF;
+    uint16_t baseline = thresholdBuf[MPR121_BASELINE_0 + e] << 2;
+    int32_t delta = (int32_t)baseline - filtered;
+
+    if (touched & (1 << e)) {
+      if (t.touchedSince == 0) t.touchedSince = millis() | 1;
+      if (delta > 0) t.depth16 += (delta * 16 - t.depth16) / 8;
+      if (!t.stuck && millis() - t.touchedSince >= stuckTouchMs) {
+        t.stuck = true;
+        snprintf(msg, sizeof(msg), "ElectrodeStuck:%s:baseline=%u:filtered=%u", channel[ch].name, baseline, filtered);
+        Event = msg;
+        logdata();
+        recalibrateElectrodes();
       }
-
-      leftInterval = 0.0;      
-      while (digitalRead (LEFT_POKE) == LOW) {  //Hang here until poke is clear
-        if (whitenoise) {
-          int freq = random(50,250);
-          tone(BUZZER, freq, 10);
-        }
-      }  
-
-      leftInterval = (millis() - leftPokeTime);
-      Event = "LeftinTimeOut";
+      continue;
+    }
+    t.touchedSince = 0;
+    if (t.stuck) {
+      t.stuck = false;
+      Event = String("ElectrodeReleased:") + channel[ch].name;
       logdata();
     }
+    t.noise16 += (abs(delta) * 16 - t.noise16) / 16;
+    if (t.samples < THRESHOLD_WARMUP) {
+      t.samples++;
+      continue;
+    }
 
-    if (digitalRead(RIGHT_POKE) == LOW) {        //If right poke is triggered
-      if (reset) {
-        timeoutStart = millis();
-      }
-      if (countAllPokes) {
-        RightCount ++;
-      }
-      rightPokeTime = millis();
+    int32_t touch = (4 * t.noise16) / 16 + 3;
+    if (t.depth16 > 0) touch = max(touch, t.depth16 / 48);
+    touch = constrain(touch, TOUCH_THRESHOLD_MIN, TOUCH_THRESHOLD_MAX);
+    if (abs(touch - touchThreshold[e]) < 2) continue;      //hysteresis, no rewrite for jitter
+    uint8_t release = max(touch / 2, (int32_t)2);
+    setElectrodeThresholds(e, touch, release);
+    snprintf(msg, sizeof(msg), "Threshold:%s:touch=%ld:release=%u:baseline=%u:noise=%ld.%02ld", channel[ch].name,
+             (long)touch, release, baseline, (long)(t.noise16 / 16), (long)((t.noise16 % 16) * 100 / 16));
+    Event = msg;
+    logdata();
+  }
+}
 
-      rightInterval = 0.0;  
-      while (digitalRead (LEFT_POKE) == LOW) { //Hang here until poke is clear
-        if (whitenoise) {
-          int freq = random(50,250);
-          tone(BUZZER, freq, 10);
-        }
-      }   
-      rightInterval = (millis() - rightPokeTime);
-      UpdateDisplay();
-      Event = "RightinTimeout";
+//Write one electrode's thresholds.  The MPR121 briefly leaves run mode for the write
+void FED3::setElectrodeThresholds(uint8_t electrode, uint8_t touch, uint8_t release) {
+  if (electrode >= 12) return;
+  mprAcquire();
+  cap.writeRegister(MPR121_TOUCHTH_0 + 2 * electrode, touch);
+  cap.writeRegister(MPR121_RELEASETH_0 + 2 * electrode, release);
+  mprRelease();
+  touchThreshold[electrode] = touch;
+  releaseThreshold[electrode] = release;
+}
+
+//Stop and restart the electrodes, which reloads every baseline from the current data
+void FED3::recalibrateElectrodes() {
+  mprAcquire();
+  uint8_t ecr = cap.readRegister8(MPR121_ECR);
+  cap.writeRegister(MPR121_ECR, 0x00);
+  cap.writeRegister(MPR121_ECR, ecr);
+  mprRelease();
+  Event = "ElectrodesRecalibrated";
+  logdata();
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Lick microstructure
+**************************************************************************************************************************************************/
+//Close the channel's open bout.  In LICK_LOG_BOUTS mode a counted bout is logged with the time of
+//its first lick as <name>Bout:licks=..:dur=..ms:minILI=..ms:meanILI=..ms
+void FED3::endBout(uint8_t ch) {
+  LickBouts &b = lickBouts[ch];
+  if (b.current >= boutMinLicks && b.current > 0) {
+    b.bouts++;
+    b.boutLicks += b.current;
+    b.boutMicros += b.lastLick - b.boutStart;
+    if (lickLogMode == LICK_LOG_BOUTS) {
+      char msg[80];
+      snprintf(msg, sizeof(msg), "%sBout:licks=%lu:dur=%lums:minILI=%lums:meanILI=%lums", channel[ch].name,
+               (unsigned long)b.current, (unsigned long)((b.lastLick - b.boutStart) / 1000),
+               (unsigned long)(b.current > 1 ? b.boutMinILI : 0),
+               (unsigned long)(b.current > 1 ? b.boutILISum / (b.current - 1) : 0));
+      Event = msg;
+      eventTime = b.boutStart;
       logdata();
+    }
+  }
+  b.current = 0;
+}
 
+//Add a lick at "time" (clockMicros()) to the channel's ILI histogram and bouts
+void FED3::boutLick(uint8_t ch, uint64_t time) {
+  if (ch >= TB_CHANNELS) return;
+  LickBouts &b = lickBouts[ch];
+  if (b.lastLick != 0 && time > b.lastLick) {
+    uint32_t ili = (time - b.lastLick) / 1000;
+    b.iliBins[min(ili / ILI_BIN_MS, (uint32_t)(ILI_BINS - 1))]++;
+    if (ili < boutILIMs) {
+      b.iliSum += ili;
+      b.iliCount++;
+      b.boutILISum += ili;
+      b.boutMinILI = min(b.boutMinILI, ili);
     }
+    else endBout(ch);
   }
-  display.fillRect (5, 20, 100, 25, WHITE);  //erase the data on screen without clearing the entire screen by pasting a white box over it
-  UpdateDisplay();
-  Left = false;
-  Right = false;
+  if (b.current == 0) {
+    b.boutStart = time;
+    b.boutILISum = 0;
+    b.boutMinILI = UINT32_MAX;
+  }
+  b.current++;
+  b.lastLick = time;
+  if (lickLogMode == LICK_LOG_BOUTS && lickfile) bufferLickStamp(time, ch);
+}
+
+//Queue one .LCK stamp: 48 bits of "value" and the channel, sealed with the XOR check
+void FED3::bufferLickStamp(uint64_t value, uint8_t ch) {
+  LickStamp &l = lickBuffer[lickBuffered];
+  l = {(uint32_t)value, (uint16_t)(value >> 32), ch, 0};
+  const uint8_t *p = (const uint8_t*)&l;
+  for (uint8_t i = 0; i < offsetof(LickStamp, check); i++) l.check ^= p[i];
+  if (++lickBuffered == LICK_BUFFER_STAMPS) flushLickTimes();
+}
+
+//Record a new wall offset in the .LCK file; the licks after it use it
+void FED3::writeLickOffset() {
+  if (lickLogMode != LICK_LOG_BOUTS || !lickfile) return;
+  lickOffsetsBuffered++;
+  bufferLickStamp((uint64_t)(wallOffsetAt(clockMicros()) - lickHeaderOffset), LICK_OFFSET_CHANNEL);
+}
+
+//Write the buffered lick times to the .LCK file
+void FED3::flushLickTimes() {
+  if (lickBuffered == 0 || !lickfile) return;
+  lickfile.write(lickBuffer, lickBuffered * sizeof(LickStamp));
+  lickfile.flush();
+  lickTimesWritten += lickBuffered - lickOffsetsBuffered;
+  lickBuffered = 0;
+  lickOffsetsBuffered = 0;
+}
+
+//LICK_LOG_ROWS logs every lick through logdata().  LICK_LOG_BOUTS logs a row per bout instead and
+//writes every lick time to <logfile>.LCK.  Returns false if the .LCK file cannot be opened
+bool FED3::setLickLogging(uint8_t mode) {
+  if (mode == lickLogMode) return true;
+  if (mode == LICK_LOG_BOUTS) {
+    char name[24];
+    strcpy(name, filename);
+    strcpy(name + 17, "LCK");
+    lickfile = SD.open(name, O_RDWR | O_CREAT | O_TRUNC);
+    if (!lickfile) return false;
+    lickfile.preAllocate(LICK_PREALLOCATE);
+    lickHeaderOffset = wallOffsetAt(clockMicros());
+    LickHeader h = {{'T', 'B', 'L', 'C', 'K', '2'}, sizeof(LickStamp), TB_CHANNELS, (uint64_t)lickHeaderOffset};
+    lickfile.write(&h, sizeof(h));
+    lickBuffered = 0;
+    lickOffsetsBuffered = 0;
+    lickTimesWritten = 0;
+    lickLogMode = mode;
+    boutCloseTask = every(100, [](void *fed) { static_cast<FED3*>(fed)->closeBouts(); }, this, "boutclose");
+    Event = "LickLogging:bouts";
+  }
+  else {
+    closeBouts();
+    cancelTask(boutCloseTask);
+    boutCloseTask = -1;
+    flushLickTimes();
+    lickfile.truncate();                       //give back the preallocated tail
+    lickfile.close();
+    lickLogMode = LICK_LOG_ROWS;
+    char msg[40];
+    snprintf(msg, sizeof(msg), "LickLogging:rows:stamps=%lu", (unsigned long)lickTimesWritten);
+    Event = msg;
+  }
+  logdata();
+  return true;
+}
+
+//Close bouts whose last lick is already boutILIMs old, so summaries do not wait for the next lick
+void FED3::closeBouts() {
+  uint64_t now = clockMicros();
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    LickBouts &b = lickBouts[ch];
+    if (b.current > 0 && now - b.lastLick >= (uint64_t)boutILIMs * 1000) endBout(ch);
+  }
+}
+
+uint32_t FED3::boutCount(uint8_t ch) {
+  return (ch < TB_CHANNELS) ? lickBouts[ch].bouts : 0;
+}
+
+float FED3::meanBoutLicks(uint8_t ch) {
+  if (ch >= TB_CHANNELS || lickBouts[ch].bouts == 0) return NAN;
+  return (float)lickBouts[ch].boutLicks / lickBouts[ch].bouts;
+}
+
+float FED3::meanBoutDuration(uint8_t ch) {
+  if (ch >= TB_CHANNELS || lickBouts[ch].bouts == 0) return NAN;
+  return lickBouts[ch].boutMicros / 1000000.0 / lickBouts[ch].bouts;
+}
+
+float FED3::meanILI(uint8_t ch) {
+  if (ch >= TB_CHANNELS || lickBouts[ch].iliCount == 0) return NAN;
+  return (float)lickBouts[ch].iliSum / lickBouts[ch].iliCount;
+}
+
+uint32_t FED3::iliHistogram(uint8_t ch, uint8_t bin) {
+  return (ch < TB_CHANNELS && bin < ILI_BINS) ? lickBouts[ch].iliBins[bin] : 0;
+}
+
+//Append one row per channel with the running totals to <logfile>_BOUTS.CSV
+void FED3::writeBoutSummary() {
+  closeBouts();
+  flushLickTimes();
+  char name[32];
+  strcpy(name, filename);
+  strcpy(name + 16, "_BOUTS.CSV");
+  FsFile file = SD.open(name, FILE_WRITE);
+  if (!file) return;
+  if (file.size() == 0) {
+    file.print("MM:DD:YYYY hh:mm:ss,Channel,Licks,Bouts,Mean_Bout_Licks,Mean_Bout_Duration,Mean_ILI");
+    for (uint8_t bin = 0; bin < ILI_BINS - 1; bin++) file.printf(",ILI_%u", bin * ILI_BIN_MS);
+    file.printf(",ILI_%u+\r\n", (ILI_BINS - 1) * ILI_BIN_MS);
+  }
+  time_t nowTime = wallMicros() / 1000000;
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    file.printf("%u/%u/%u %u:%02u:%02u,%s,%lu,%lu,", month(nowTime), day(nowTime), year(nowTime), hour(nowTime),
+                minute(nowTime), second(nowTime), channel[ch].name, (unsigned long)channel[ch].licks,
+                (unsigned long)boutCount(ch));
+    file.print(meanBoutLicks(ch), 2);
+    file.print(",");
+    file.print(meanBoutDuration(ch), 3);
+    file.print(",");
+    file.print(meanILI(ch), 1);
+    for (uint8_t bin = 0; bin < ILI_BINS; bin++) file.printf(",%lu", (unsigned long)lickBouts[ch].iliBins[bin]);
+    file.print("\r\n");
+  }
+  file.close();
 }
 
 /**************************************************************************************************************************************************
-                                                                                       Audio and neopixel stimuli
+                                                                                                   Raw capacitance capture
 **************************************************************************************************************************************************/
-void FED3::ConditionedStimulus(int duration) {
-  tone (BUZZER, 4000, duration);
-  pixelsOn(0,0,10,0);  //blue light for all
+//Completion of a raw burst read: seal the frame and publish it
+FASTRUN static void rawReadDone(void *arg, bool ok) {
+  FED3 *fed = static_cast<FED3*>(arg);
+  if (ok) {
+    RawSample &r = rawQueue[rawHead];
+    uint8_t x = 0;
+    const uint8_t *b = (const uint8_t*)&r;
+    for (uint8_t i = 0; i < offsetof(RawSample, check); i++) x ^= b[i];
+    r.check = x;
+    rawHead = (rawHead + 1) % RAW_QUEUE_SIZE;
+    fed->rawSamples++;
+  }
+  else fed->rawSamplesDropped++;
+  rawInFlight = false;
 }
 
-void FED3::Click() {
-  tone (BUZZER, 800, 8);
+//Start the burst read of sample rawPendingSeq.  Runs with interrupts off or in an interrupt
+FASTRUN static void rawStartRead() {
+  FED3 *fed = pointerToFED3;
+  rawReadPending = false;
+  uint16_t next = (rawHead + 1) % RAW_QUEUE_SIZE;
+  if (next == rawTail) {                       //the writer is behind, lose this one
+    fed->rawSamplesDropped++;
+    return;
+  }
+  RawSample &r = rawQueue[rawHead];
+  r.sync = RAW_SYNC;
+  r.seq = rawPendingSeq;
+  r.micros = (uint32_t)fed->clockMicros();
+  rawInFlight = true;
+  if (!fed->mprReadAsync(0x00, r.regs, MPR121_RAW_BYTES, rawReadDone, fed)) {
+    rawInFlight = false;
+    rawReadPending = true;                     //started by mprFinish()/mprRelease() when the bus frees up
+  }
 }
 
-void FED3::Tone(int freq, int duration){
-  tone (BUZZER, freq, duration);
+//GPT1 tick: one sample per interval.  Every period without a read, whether the previous one
+//was still running or ticks were lost with interrupts off, takes a sequence number so the
+//host sees the gap
+FASTRUN static void outsideRawTimerHandler(void) {
+  GPT1_SR = GPT_SR_OF1;
+  FED3 *fed = pointerToFED3;
+  uint32_t now = micros();
+  uint32_t periods = (now - rawCapture.last + rawCapture.interval / 2) / rawCapture.interval;
+  rawCapture.last = now;
+  if (periods > 1) {
+    fed->rawSamplesDropped += periods - 1;
+    rawCapture.seq += periods - 1;
+  }
+  if (rawInFlight || rawReadPending) {
+    fed->rawSamplesDropped++;
+    rawCapture.seq++;
+  }
+  else {
+    rawPendingSeq = rawCapture.seq++;
+    rawStartRead();
+  }
+  asm volatile("dsb");
 }
 
-void FED3::stopTone(){
-  noTone (BUZZER);
+//GPT1 interrupt every intervalMicros, counting the 24 MHz crystal
+static void rawTimerBegin(uint32_t intervalMicros) {
+  CCM_CCGR1 |= CCM_CCGR1_GPT1_BUS(CCM_CCGR_ON) | CCM_CCGR1_GPT1_SERIAL(CCM_CCGR_ON);
+  GPT1_CR = 0;
+  GPT1_PR = GPT_PR_PRESCALER24M(0);
+  GPT1_SR = 0x3F;
+  GPT1_OCR1 = 24 * intervalMicros - 1;
+  GPT1_IR = GPT_IR_OF1IE;
+  attachInterruptVector(IRQ_GPT1, outsideRawTimerHandler);
+  NVIC_SET_PRIORITY(IRQ_GPT1, RAW_TIMER_PRIORITY);
+  NVIC_ENABLE_IRQ(IRQ_GPT1);
+  GPT1_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_EN;   //restart mode: compare 1 resets the count
 }
 
+//Stream the MPR121 data block every intervalMicros (the chip filters at 1 ms at best) to a
+//.RAW file next to the logfile or to USB.  GPT1 paces the reads, so the rate does not depend
+//on run(); serviceRawCapture() only writes the queue out.  Licks are still detected from the
+//touch status
+bool FED3::startRawCapture(uint8_t dest, uint32_t intervalMicros) {
+  if (rawCaptureActive) stopRawCapture();
+  if (dest == RAW_TO_FILE) {
+    char name[24];
+    strcpy(name, filename);
+    strcpy(name + 17, "RAW");
+    rawfile = SD.open(name, O_RDWR | O_CREAT | O_TRUNC);
+    if (!rawfile) return false;
+    rawfile.preAllocate(RAW_PREALLOCATE);
+  }
+  rawHead = rawTail = 0;
+  rawReadPending = false;
+  rawCapture = {dest, max(intervalMicros, (uint32_t)RAW_MIN_INTERVAL), (uint32_t)micros(), 0};
+  rawSamples = 0;
+  rawSamplesDropped = 0;
+  RawHeader h = {{'T', 'B', 'R', 'A', 'W', '1'}, sizeof(RawSample), MPR121_RAW_BYTES,
+                 rawCapture.interval, 0, wallMicros()};
+  if (dest == RAW_TO_FILE) rawfile.write(&h, sizeof(h));
+  else Serial.write((const uint8_t*)&h, sizeof(h));
+  rawCaptureActive = true;
+  rawTimerBegin(rawCapture.interval);
+  Event = (dest == RAW_TO_FILE) ? "RawCaptureStart:file" : "RawCaptureStart:usb";
+  logdata();
+  return true;
+}
 
-void FED3::Noise(int duration) {
-  // White noise to signal errors
-  for (int i = 0; i < duration/50; i++) {
-    tone (BUZZER, random(50, 250), 50);
-    delay(duration/50);
+void FED3::stopRawCapture() {
+  if (!rawCaptureActive) return;
+  rawCaptureActive = false;
+  GPT1_CR = 0;
+  NVIC_DISABLE_IRQ(IRQ_GPT1);
+  rawReadPending = false;
+  while (rawInFlight) serviceMprBus();         //let the last read land, or time it out
+  while (rawTail != rawHead) {                 //write what is still queued
+    uint16_t n = (rawHead > rawTail) ? rawHead - rawTail : RAW_QUEUE_SIZE - rawTail;
+    if (rawCapture.dest == RAW_TO_FILE) rawfile.write(&rawQueue[rawTail], n * sizeof(RawSample));
+    else Serial.write((const uint8_t*)&rawQueue[rawTail], n * sizeof(RawSample));
+    rawTail = (rawTail + n) % RAW_QUEUE_SIZE;
   }
+  if (rawCapture.dest == RAW_TO_FILE) {
+    rawfile.truncate();                        //give back the preallocated tail
+    rawfile.close();
+  }
+  char msg[48];
+  snprintf(msg, sizeof(msg), "RawCaptureStop:samples=%lu:dropped=%lu", (unsigned long)rawSamples,
+           (unsigned long)rawSamplesDropped);
+  Event = msg;
+  logdata();
 }
 
-//Turn all pixels on to a specific color
-void FED3::pixelsOn(int R, int G, int B, int W) {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);  //ENABLE motor driver
-  delay(2); //let things settle
-  for (uint16_t i = 0; i < 8; i++) {
-    strip.setPixelColor(i, R, G, B, W);
-    strip.show();
+//Write out a block of samples if one is ready
+void FED3::serviceRawCapture() {
+  uint16_t queued = (rawHead + RAW_QUEUE_SIZE - rawTail) % RAW_QUEUE_SIZE;
+  if (queued < RAW_WRITE_SAMPLES) return;
+  uint16_t n = min(queued, (uint16_t)(RAW_QUEUE_SIZE - rawTail));   //contiguous run up to the end of the ring
+  n = min(n, (uint16_t)RAW_WRITE_SAMPLES);
+  if (rawCapture.dest == RAW_TO_FILE) {
+    if (rawfile.write(&rawQueue[rawTail], n * sizeof(RawSample)) != n * sizeof(RawSample)) return;
+  }
+  else {
+    if (Serial.availableForWrite() < (int)(n * sizeof(RawSample))) return;   //host is not reading, keep queueing
+    Serial.write((const uint8_t*)&rawQueue[rawTail], n * sizeof(RawSample));
   }
+  rawTail = (rawTail + n) % RAW_QUEUE_SIZE;
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Progressive ratio
+**************************************************************************************************************************************************/
+static uint32_t prRatio(const PRState &pr) {
+  uint16_t i = min(pr.index, (uint16_t)(PR_TABLE_SIZE - 1));
+  switch (pr.series) {
+    case PR_SERIES_RR:       return prRichardsonRoberts.ratio[i];
+    case PR_SERIES_DOUBLING: return prDoubling.ratio[i];
+    default:                 return 1 + (uint32_t)pr.index * pr.step;
+  }
+}
+
+//Start (or restart) a progressive ratio on "side" at the first ratio of the series
+void FED3::startPR(uint8_t side, uint8_t series, uint16_t step) {
+  if (side >= TB_CHANNELS) return;
+  PRState &pr = prState[side];
+  pr.active = true;
+  pr.broken = false;
+  pr.series = series;
+  pr.step = max(step, (uint16_t)1);
+  pr.index = 0;
+  pr.requirement = prRatio(pr);
+  pr.progress = 0;
+  pr.lastCompleted = 0;
+  pr.lastResponse = millis();
+  FR = pr.requirement;
+}
+
+void FED3::stopPR(uint8_t side) {
+  if (side < TB_CHANNELS) prState[side].active = false;
+}
+
+//Count an active response.  Returns true when it completes the current ratio; the
+//requirement then moves to the next ratio of the series
+bool FED3::prResponse(uint8_t side) {
+  if (side >= TB_CHANNELS || !prState[side].active) return false;
+  PRState &pr = prState[side];
+  pr.lastResponse = millis();
+  pr.broken = false;
+  if (++pr.progress < pr.requirement) return false;
+  pr.lastCompleted = pr.requirement;
+  pr.progress = 0;
+  pr.index++;
+  pr.requirement = prRatio(pr);
+  FR = pr.requirement;
+  return true;
+}
+
+uint32_t FED3::prRequirement(uint8_t side) {
+  return (side < TB_CHANNELS) ? prState[side].requirement : 0;
+}
+
+uint32_t FED3::prLastCompleted(uint8_t side) {
+  return (side < TB_CHANNELS) ? prState[side].lastCompleted : 0;
+}
+
+//Log a breakpoint once no active response has come for prBreakpointTimeout
+void FED3::servicePR() {
+  for (uint8_t side = 0; side < TB_CHANNELS; side++) {
+    PRState &pr = prState[side];
+    if (!pr.active || pr.broken || millis() - pr.lastResponse < prBreakpointTimeout) continue;
+    pr.broken = true;
+    char msg[56];
+    snprintf(msg, sizeof(msg), "Breakpoint:%s:ratio=%lu:reached=%u", channel[side].name,
+             (unsigned long)pr.lastCompleted, pr.index);
+    Event = msg;
+    logdata();
+  }
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Random numbers and bandit
+**************************************************************************************************************************************************/
+//Seed the session generator.  The same seed and the same responses replay the same session
+void FED3::seedRandom(uint64_t seed) {
+  rngSeed = seed;
+  pcgState = 0;
+  randomNumber();
+  pcgState += seed;
+  randomNumber();
+}
+
+uint32_t FED3::randomNumber() {
+  uint64_t old = pcgState;
+  pcgState = old * 6364136223846793005ULL + pcgIncrement;
+  uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+  uint32_t rot = old >> 59;
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+//Uniform in 0..n-1 (multiply-shift, bias below 2^-32 * n)
+uint32_t FED3::randomNumber(uint32_t n) {
+  return ((uint64_t)randomNumber() * n) >> 32;
+}
+
+//A fresh seed from the RTC, the cycle counter and ADC noise, mixed by splitmix64
+static uint64_t freshSeed() {
+  uint64_t z = rtcMicros() ^ ((uint64_t)ARM_DWT_CYCCNT << 32) ^ analogRead(VBATPIN);
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return z ? z : 1;
+}
+
+//Start a two-armed bandit: each poke on a side is rewarded with that side's probability (%).
+//After switchEvery rewards (or trials, with BANDIT_SWITCH_TRIALS) the probabilities swap;
+//0 never switches.  Reward and block counts go to the existing bandit log columns
+void FED3::startBandit(uint8_t probLeft, uint8_t probRight, uint16_t switchEvery, uint8_t switchOn) {
+  prob_left = min(probLeft, (uint8_t)100);
+  prob_right = min(probRight, (uint8_t)100);
+  pelletsToSwitch = switchEvery;
+  banditSwitchOn = switchOn;
+  BlockPelletCount = 0;
+  banditTrials = 0;
+  banditActive = true;
+}
+
+void FED3::stopBandit() {
+  banditActive = false;
+}
+
+//One trial (a poke on "side").  Returns true if it is rewarded; the caller dispenses.
+//A block that is complete switches at the next trial, so the reward row keeps its block's odds
+bool FED3::banditResponse(uint8_t side) {
+  if (!banditActive || side > SIDE_RIGHT) return false;
+  int blockCount = (banditSwitchOn == BANDIT_SWITCH_TRIALS) ? banditTrials : BlockPelletCount;
+  if (pelletsToSwitch > 0 && blockCount >= pelletsToSwitch) {
+    int p = prob_left;
+    prob_left = prob_right;
+    prob_right = p;
+    BlockPelletCount = 0;
+    banditTrials = 0;
+    char msg[32];
+    snprintf(msg, sizeof(msg), "BlockSwitch:%d/%d", prob_left, prob_right);
+    Event = msg;
+    logdata();
+  }
+  banditTrials++;
+  int prob = (side == SIDE_LEFT) ? prob_left : prob_right;
+  if ((int)randomNumber(100) >= prob) return false;
+  BlockPelletCount++;
+  return true;
+}
+
+//Bandit sessions log PelletsToSwitch/Prob_left/Prob_right and High_prob_poke
+bool FED3::banditSession() {
+  return banditActive || sessiontype.startsWith("Bandit");
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Schedule file
+**************************************************************************************************************************************************/
+// A schedule file holds one "key value" setting per line, "#" starts a comment:
+//
+//   name     VI30                 session type shown on screen and logged
+//   rule     VI 30                FR n | VR n | PR step|RR|DOUBLING | FI s | VI s | LICK n | BANDIT pLeft pRight [block] | EXT
+//   active   left                 left | right | both
+//   timeout  10                   s of timeout after each reward (optional)
+//   cue      on                   tone and lights with each reward (optional, default on)
+//   breakpoint 3600               PR: s without an active response that ends the ratio run
+//
+// Returns false if the file is missing or has an error, and the sketch keeps control
+bool FED3::loadSchedule(const char *path) {
+  scheduleLoaded = false;
+  FsFile file = SD.open(path, FILE_READ);
+  if (!file) return false;
+
+  Schedule sc;
+  memset(&sc, 0, sizeof(sc));
+  sc.active = 0x01;
+  sc.cue = true;
+  char line[64];
+  uint16_t lineNumber = 0;
+  bool ok = true;
+  int c = 0;
+  while (ok && c >= 0) {
+    uint8_t len = 0;
+    while ((c = file.read()) >= 0 && c != '\n') {
+      if (len < sizeof(line) - 1) line[len++] = c;
+    }
+    line[len] = '\0';
+    lineNumber++;
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+    char *save;
+    char *key = strtok_r(line, " \t\r", &save);
+    if (key == nullptr) continue;
+    char *value = strtok_r(nullptr, " \t\r", &save);
+    if (value == nullptr) ok = false;
+    else if (strcasecmp(key, "name") == 0) sessiontype = value;
+    else if (strcasecmp(key, "active") == 0) {
+      if (strcasecmp(value, "left") == 0) sc.active = 0x01;
+      else if (strcasecmp(value, "right") == 0) sc.active = 0x02;
+      else if (strcasecmp(value, "both") == 0) sc.active = 0x03;
+      else ok = false;
+    }
+    else if (strcasecmp(key, "timeout") == 0) sc.timeout = atoi(value);
+    else if (strcasecmp(key, "cue") == 0) sc.cue = (strcasecmp(value, "off") != 0);
+    else if (strcasecmp(key, "breakpoint") == 0) prBreakpointTimeout = atol(value) * 1000UL;
+    else if (strcasecmp(key, "rule") == 0) {
+      char *a = strtok_r(nullptr, " \t\r", &save);
+      char *b = strtok_r(nullptr, " \t\r", &save);
+      char *blk = strtok_r(nullptr, " \t\r", &save);
+      char *on = strtok_r(nullptr, " \t\r", &save);
+      snprintf(scheduleRule, sizeof(scheduleRule), "%s%s%s%s%s%s%s%s%s", value, a ? " " : "", a ? a : "",
+               b ? " " : "", b ? b : "", blk ? " " : "", blk ? blk : "", on ? " " : "", on ? on : "");
+      float n = a ? atof(a) : 0;
+      if (strcasecmp(value, "FR") == 0) { sc.rule = SCHED_FR; sc.param = n; }
+      else if (strcasecmp(value, "VR") == 0) { sc.rule = SCHED_VR; sc.param = n; }
+      else if (strcasecmp(value, "PR") == 0) {
+        sc.rule = SCHED_PR;
+        if (a && strcasecmp(a, "RR") == 0) { sc.series = PR_SERIES_RR; sc.param = 1; }
+        else if (a && strcasecmp(a, "DOUBLING") == 0) { sc.series = PR_SERIES_DOUBLING; sc.param = 1; }
+        else { sc.series = PR_SERIES_LINEAR; sc.param = a ? n : 1; }
+      }
+      else if (strcasecmp(value, "FI") == 0) { sc.rule = SCHED_FI; sc.param = n * 1000; }
+      else if (strcasecmp(value, "VI") == 0) { sc.rule = SCHED_VI; sc.param = n * 1000; }
+      else if (strcasecmp(value, "LICK") == 0) { sc.rule = SCHED_LICK; sc.param = n; }
+      else if (strcasecmp(value, "EXT") == 0) { sc.rule = SCHED_EXT; sc.param = 1; }
+      else if (strcasecmp(value, "BANDIT") == 0 && b) {
+        sc.rule = SCHED_BANDIT;
+        sc.param = 1;
+        sc.prob[0] = constrain(atoi(a), 0, 100);
+        sc.prob[1] = constrain(atoi(b), 0, 100);
+        sc.blockLength = blk ? atoi(blk) : 0;
+        sc.switchOn = (on && strcasecmp(on, "trials") == 0) ? BANDIT_SWITCH_TRIALS : BANDIT_SWITCH_REWARDS;
+        sc.active = 0x03;
+      }
+      else ok = false;
+      if (sc.param == 0) ok = false;
+    }
+    else ok = false;
+  }
+  file.close();
+  if (!ok || sc.rule == SCHED_NONE) {
+    Serial.print(path); Serial.print(F(": error on line ")); Serial.println(lineNumber);
+    return false;
+  }
+
+  // Variable schedules: VR requirements are spread evenly over 1..2n-1, VI intervals follow the
+  // Fleshler-Hoffman progression with mean param; both are shuffled
+  for (uint8_t i = 0; i < SCHEDULE_TABLE_SIZE; i++) {
+    if (sc.rule == SCHED_VR) {
+      sc.table[i] = 1 + (uint32_t)((2 * sc.param - 1) * (i + 0.5f) / SCHEDULE_TABLE_SIZE);
+    }
+    else if (sc.rule == SCHED_VI) {
+      float N = SCHEDULE_TABLE_SIZE, k = N - (i + 1);
+      float t = 1 + logf(N) + (k > 0 ? k * logf(k) : 0) - (k + 1) * logf(k + 1);
+      sc.table[i] = sc.param * t;
+    }
+  }
+  for (uint8_t i = SCHEDULE_TABLE_SIZE - 1; i > 0; i--) {
+    uint8_t j = randomNumber(i + 1);
+    uint32_t t = sc.table[i];
+    sc.table[i] = sc.table[j];
+    sc.table[j] = t;
+  }
+  schedule = sc;
+  schedule.requirement = 0;
+  nextRequirement();
+  if (sc.rule == SCHED_BANDIT) startBandit(sc.prob[0], sc.prob[1], sc.blockLength, sc.switchOn);
+  if (sc.rule == SCHED_PR) {
+    for (uint8_t side = 0; side < 2; side++) {
+      if (sc.active & (1 << side)) startPR(side, sc.series, sc.param);
+    }
+  }
+  schedule.lastReward = millis();
+  activePoke = (sc.active == 0x02) ? 0 : 1;
+  scheduleLoaded = true;
+  return true;
+}
+
+//Call once per loop after run() to let the schedule file drive the session
+void FED3::runSchedule() {
+  if (!scheduleLoaded) return;
+  if (Left) schedulePoke(SIDE_LEFT);
+  if (Right) schedulePoke(SIDE_RIGHT);
+  if (schedule.rule == SCHED_LICK) {
+    if (lickLeftFlag) {
+      lickLeftFlag = false;
+      scheduleResponse(SIDE_LEFT);
+    }
+    if (lickRightFlag) {
+      lickRightFlag = false;
+      scheduleResponse(SIDE_RIGHT);
+    }
+  }
+}
+
+void FED3::schedulePoke(uint8_t side) {
+  if (side == SIDE_LEFT) logLeftPoke();
+  else logRightPoke();
+  if (schedule.rule != SCHED_LICK) scheduleResponse(side);
+}
+
+//One response (poke, or lick for LICK schedules) on "side"
+void FED3::scheduleResponse(uint8_t side) {
+  Schedule &sc = schedule;
+  if (!(sc.active & (1 << side)) || inTimeout()) return;
+  switch (sc.rule) {
+    case SCHED_FR:
+    case SCHED_VR:
+    case SCHED_LICK:
+      if (++sc.progress >= sc.requirement) scheduleReward(side);
+      break;
+    case SCHED_PR:
+      if (prResponse(side)) scheduleReward(side);
+      break;
+    case SCHED_FI:
+    case SCHED_VI:
+      if (millis() - sc.lastReward >= sc.requirement) scheduleReward(side);
+      break;
+    case SCHED_BANDIT:
+      if (banditResponse(side)) scheduleReward(side);
+      break;
+  }
+}
+
+void FED3::scheduleReward(uint8_t side) {
+  if (schedule.cue) ConditionedStimulus();
+  if (side == SIDE_LEFT) FeedLeft();
+  else FeedRight();
+  schedule.lastReward = millis();
+  schedule.progress = 0;
+  nextRequirement();
+  if (schedule.timeout > 0) startTimeout(schedule.timeout);
+}
+
+//Look up what the next reward takes
+void FED3::nextRequirement() {
+  Schedule &sc = schedule;
+  switch (sc.rule) {
+    case SCHED_VR:
+    case SCHED_VI:
+      sc.requirement = sc.table[sc.next];
+      sc.next = (sc.next + 1) % SCHEDULE_TABLE_SIZE;
+      break;
+    case SCHED_PR:
+      break;                                 //the PR engine keeps one requirement per side
+    case SCHED_BANDIT:
+      sc.requirement = 1;                    //the bandit engine keeps the odds and blocks
+      break;
+    default:
+      sc.requirement = sc.param;
+      break;
+  }
+  if (sc.rule == SCHED_FR || sc.rule == SCHED_VR) FR = sc.requirement;
+}
+
+/**************************************************************************************************************************************************
+                                                                                                   Awaitable trial steps
+**************************************************************************************************************************************************/
+//Each of these is polled by TB_AWAIT and returns true once it has finished; b.result says how
+
+//Wait for a poke (Left/Right raised by run()); result is false if timeoutMs (0 = forever) passed first
+bool FED3::waitPoke(Behaviour &b, uint8_t side, uint32_t timeoutMs) {
+  if (!b.armed) {
+    b.armed = true;
+    b.since = millis();
+  }
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    if ((side != SIDE_ANY && side != ch) || !channel[ch].poked) continue;
+    b.side = ch;
+    b.result = true;
+    return true;
+  }
+  if (timeoutMs != 0 && millis() - b.since >= timeoutMs) {
+    b.result = false;
+    return true;
+  }
+  return false;
+}
+
+//Wait for a lick; the lick flag is cleared when it is taken
+bool FED3::waitLick(Behaviour &b, uint8_t side, uint32_t timeoutMs) {
+  if (!b.armed) {
+    b.armed = true;
+    b.since = millis();
+  }
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    if ((side != SIDE_ANY && side != ch) || !channel[ch].lickFlag) continue;
+    channel[ch].lickFlag = false;
+    b.side = ch;
+    b.result = true;
+    return true;
+  }
+  if (timeoutMs != 0 && millis() - b.since >= timeoutMs) {
+    b.result = false;
+    return true;
+  }
+  return false;
+}
+
+bool FED3::wait(Behaviour &b, uint32_t ms) {
+  if (!b.armed) {
+    b.armed = true;
+    b.since = millis();
+  }
+  b.result = true;
+  return millis() - b.since >= ms;
+}
+
+//Dispense one dose (or "steps") without blocking and log it like FeedLeft()/FeedRight()
+bool FED3::dispense(Behaviour &b, uint8_t side, int steps) {
+  if (!b.armed) {
+    if (side >= TB_CHANNELS) return true;
+    if (steps == 0) steps = channel[side].doseSteps;
+    if (!startRotate(side, steps)) return false;
+    channel[side].motorTurns = 0;
+    b.armed = true;
+    b.since = millis();
+  }
+  if (motorBusy(side)) return false;
+  pixelsOff();
+  finishFeed(side, 0);
+  b.result = true;
+  return true;
+}
+
+//helper function for lick sensor
+void FED3::serviceLicks(){
+  uint8_t section = enterSection(SECTION_LICKS);
+  static uint16_t lastLick = 0; //last time a lick was detected
+  uint16_t currentLick;
+  noInterrupts();
+  bool haveTouched = isrTouchedValid;   //the interrupt already read the status
+  currentLick = isrTouched;
+  uint64_t lickTime = haveTouched ? isrTouchedTime : lickIRQTime;
+  isrTouchedValid = false;
+  lickIRQ = false; //reset lick interrupt flag
+  interrupts();
+  if (!haveTouched) {
+    mprAcquire();                       //the async read failed, read it the blocking way
+    currentLick = cap.touched();
+    mprRelease();
+    noInterrupts();
+    lickTTL(currentLick, lickIRQTime);  //slow path: the async read failed, fire from the blocking read
+    interrupts();
+  }
+  uint16_t rise = currentLick & ~lastLick; //current time in ms
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    Channel &c = channel[ch];
+    if (c.pins.electrode >= 12 || !(rise & (1 << c.pins.electrode))) continue;
+    c.licks++;
+    c.lickFlag = true; //set the lick flag
+    c.dropAvailable = false; //reset the well
+    boutLick(ch, lickTime);
+    eventTime = lickTime;
+    logLick(ch);
+  }
+  lastLick = currentLick; //update last lick time
+  heartbeat(SECTION_LICKS);
+  enterSection(section);
+}
+
+//MPR121 interrupt.  Start the touch status read; reading it also releases the IRQ line
+void FED3::lickInterrupt(){
+  lickIRQTime = clockMicros();
+  if (!mprReadAsync(0x00, touchBuf, 2, touchReadDone, this)) {
+    touchReadPending = true;            //started when the bus frees up
+  }
+}
+
+//Read len registers from reg without waiting.  cb(arg, ok) runs in the I2C interrupt when the
+//transfer is over.  Returns false if a transfer is running or the main code holds the bus
+bool FED3::mprReadAsync(uint8_t reg, uint8_t *buf, uint8_t len, I2CCallback cb, void *arg) {
+  if (len == 0) return false;
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  bool started = !mprAsync.busy && !mprBusy;
+  if (started) {
+    mprAsync.busy = true;
+    mprAsync.buf = buf;
+    mprAsync.len = len;
+    mprAsync.received = 0;
+    mprAsync.start = micros();
+    mprAsync.cmds[0] = LPI2C_MTDR_CMD_START | (MPR121_ADDR << 1);
+    mprAsync.cmds[1] = LPI2C_MTDR_CMD_TRANSMIT | reg;
+    mprAsync.cmds[2] = LPI2C_MTDR_CMD_START | (MPR121_ADDR << 1) | 1;
+    mprAsync.cmds[3] = LPI2C_MTDR_CMD_RECEIVE | (len - 1);
+    mprAsync.cmds[4] = LPI2C_MTDR_CMD_STOP;
+    mprAsync.cmdsSent = 0;
+    mprAsync.stopping = false;
+    mprAsync.cb = cb;
+    mprAsync.arg = arg;
+    LPI2C4_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+    LPI2C4_MSR = MPR_I2C_ERRORS | LPI2C_MSR_SDF | LPI2C_MSR_EPF;
+    LPI2C4_MFCR = LPI2C_MFCR_TXWATER(1) | LPI2C_MFCR_RXWATER(0);
+    LPI2C4_MIER = LPI2C_MIER_TDIE | LPI2C_MIER_RDIE | LPI2C_MIER_SDIE | LPI2C_MIER_NDIE |
+                  LPI2C_MIER_ALIE | LPI2C_MIER_FEIE;
+    mprFeed();
+  }
+  if (!primask) __enable_irq();
+  return started;
+}
+
+//Take the bus for blocking Wire/Adafruit calls, waiting out a running async read
+void FED3::mprAcquire() {
+  while (true) {
+    noInterrupts();
+    if (!mprAsync.busy) {
+      mprBusy = true;
+      interrupts();
+      return;
+    }
+    interrupts();
+    serviceMprBus();                    //a stuck transfer is reset after MPR_TRANSFER_TIMEOUT
+  }
+}
+
+//A transfer that never finishes (NACK without a STOP, a slave holding SDA low) would keep the
+//bus taken for good.  Past MPR_TRANSFER_TIMEOUT the LPI2C4 master is stopped, SCL is clocked nine
+//times to free SDA, Wire2 is set up again and the transfer is failed to its callback.  SCL is
+//driven open-drain so a slave stretching the clock is never fought
+void FED3::serviceMprBus() {
+  noInterrupts();
+  bool overdue = mprAsync.busy && (micros() - mprAsync.start) > MPR_TRANSFER_TIMEOUT;
+  if (overdue) {
+    LPI2C4_MIER = 0;
+    LPI2C4_MCR &= ~LPI2C_MCR_MEN;
+    LPI2C4_MCR |= LPI2C_MCR_RTF | LPI2C_MCR_RRF;
+    LPI2C4_MSR = MPR_I2C_ERRORS | LPI2C_MSR_SDF | LPI2C_MSR_EPF;
+  }
+  interrupts();
+  if (!overdue) return;
+  pinMode(MPR121_SCL, OUTPUT_OPENDRAIN);   //HIGH releases the line to the pullup
+  for (uint8_t i = 0; i < 9; i++) {
+    digitalWrite(MPR121_SCL, LOW);
+    delayMicroseconds(5);
+    digitalWrite(MPR121_SCL, HIGH);
+    delayMicroseconds(5);
+  }
+  mprWire->begin();                    //hands the pins back to LPI2C4 and enables the master
+  mprWire->setClock(400000);
+  mprBusResets++;
+  noInterrupts();
+  mprFinish(false);
+  interrupts();
+  Event = "I2CReset:MPR121";
+  logdata();
+}
+
+//Give the bus back and start a touch read that was held off meanwhile
+void FED3::mprRelease() {
+  mprBusy = false;
+  noInterrupts();
+  if (touchReadPending && mprReadAsync(0x00, touchBuf, 2, touchReadDone, this)) touchReadPending = false;
+  if (rawReadPending && !mprAsync.busy) rawStartRead();
+  interrupts();
+}
+
+//Fire BNC_OUT on the onset of a touch on any electrode in lickTTLMask and record the
+//latency from the MPR121 interrupt.  Returns true if a pulse was started
+bool FED3::lickTTL(uint16_t touched, uint64_t irqTime){
+  uint16_t onset = touched & ~ttlLastTouched & lickTTLMask;
+  ttlLastTouched = touched;
+  if (onset == 0) return false;
+  LickTTLStats &st = lickTTLStats;
+  if (pulseTrain.active) {               //never cut into a train from the I2C interrupt
+    st.blocked++;
+    return false;
+  }
+  startPulseTrain(lickTTLWidthMicros, lickTTLWidthMicros + 1, 1);
+  uint32_t latency = clockMicros() - irqTime;
+  st.count++;
+  st.sumMicros += latency;
+  if (latency < st.minMicros) st.minMicros = latency;
+  if (latency > st.maxMicros) st.maxMicros = latency;
+  st.bins[min(latency / 50, (uint32_t)(LICK_TTL_BINS - 1))]++;
+  return true;
+}
+
+//Print the lick-to-TTL latency histogram as CSV
+void FED3::printLickTTLLatency(Print &out){
+  LickTTLStats st;
+  noInterrupts();
+  st = lickTTLStats;
+  interrupts();
+  out.print(F("Lick TTL triggers,")); out.print(st.count);
+  out.print(F(",from interrupt,")); out.print(st.fastCount);
+  out.print(F(",blocked by a train,")); out.println(st.blocked);
+  if (st.count == 0) return;
+  out.print(F("Latency us min/mean/max,")); out.print(st.minMicros); out.print(",");
+  out.print((uint32_t)(st.sumMicros / st.count)); out.print(","); out.println(st.maxMicros);
+  out.println(F("Bin start us,Count"));
+  for (uint8_t i = 0; i < LICK_TTL_BINS; i++) {
+    out.print(i * 50); out.print(","); out.println(st.bins[i]);
+  }
+}
+
+//Write a summary of the lick-to-TTL latency distribution to the logfile
+void FED3::logLickTTLLatency(){
+  LickTTLStats st;
+  noInterrupts();
+  st = lickTTLStats;
+  interrupts();
+  uint32_t under250 = 0, under500 = 0, under1000 = 0;
+  for (uint8_t i = 0; i < LICK_TTL_BINS; i++) {
+    if (i < 5) under250 += st.bins[i];
+    if (i < 10) under500 += st.bins[i];
+    if (i < 19) under1000 += st.bins[i];
+  }
+  char msg[144];
+  snprintf(msg, sizeof(msg), "LickTTLLatency:n=%lu:fast=%lu:blocked=%lu:min=%luus:mean=%luus:max=%luus:lt250=%lu:lt500=%lu:lt1000=%lu",
+           (unsigned long)st.count, (unsigned long)st.fastCount, (unsigned long)st.blocked,
+           (unsigned long)(st.count ? st.minMicros : 0),
+           (unsigned long)(st.count ? st.sumMicros / st.count : 0),
+           (unsigned long)st.maxMicros,
+           (unsigned long)under250, (unsigned long)under500, (unsigned long)under1000);
+  Event = msg;
+  logdata();
+}
+
+//Function for delaying between motor movements, but also ending this delay if a pellet is detected
+bool FED3::dispenseTimer_ms(int ms) {
+  for (int i = 1; i < ms; i++) {
+    for (int j = 0; j < 10; j++) {
+  	  delayMicroseconds(100);		
+	}
+  }
+  return false;
+}
+
+//Timeout function.  Blocks the sketch for the timeout, but licks, pokes, logging and the
+//display keep being serviced.  Use startTimeout() and inTimeout() to keep the sketch running too
+void FED3::Timeout(int seconds, bool reset, bool whitenoise) {
+  startTimeout(seconds, reset, whitenoise);
+  while (timeoutActive) {
+    run();                              //the main loop, so the watchdog is fed as usual
+    if (timeoutActive && millis() - displayupdate >= 1000) {
+      displayupdate = millis();
+      UpdateDisplay();
+    }
+  }
+}
+
+//Start a timeout and return immediately, serviceEvents() runs it until it expires.
+//Pokes during the timeout do not raise Left/Right, they are logged as LeftinTimeOut/RightinTimeout
+void FED3::startTimeout(int seconds, bool reset, bool whitenoise) {
+  timeoutStart = millis();
+  timeoutLength = static_cast<unsigned long>(seconds) * 1000UL;
+  timeoutReset = reset;
+  timeoutWhiteNoise = whitenoise;
+  timeoutActive = true;
+  if (whitenoise) playNoise(0);
+}
+
+bool FED3::inTimeout() {
+  return timeoutActive;
+}
+
+//Poke entry while in timeout: optionally restart the timeout and count the poke.
+//The poke is logged when the beam clears, with its duration
+void FED3::timeoutPoke(uint8_t side) {
+  if (timeoutReset) {
+    timeoutStart = millis();
+  }
+  if (countAllPokes) channel[side].pokes ++;
+  channel[side].inTimeout = true;
+}
+
+void FED3::serviceTimeout() {
+  if (!timeoutActive) return;
+  if (millis() - timeoutStart < timeoutLength) return;
+
+  timeoutActive = false;
+  if (timeoutWhiteNoise) stopAudio();
+  if constexpr (TBConfig::display) display.fillRect (5, 20, 100, 25, WHITE);  //erase the data on screen without clearing the entire screen by pasting a white box over it
+  UpdateDisplay();
+  Left = false;
+  Right = false;
+}
+
+/**************************************************************************************************************************************************
+                                                                                       Audio and neopixel stimuli
+**************************************************************************************************************************************************/
+void FED3::ConditionedStimulus(int duration) {
+  playTone(4000, duration);
+  pixelsOn(0,0,10,0);  //blue light for all
+}
+
+void FED3::Click() {
+  playTone(800, 8);
+}
+
+void FED3::Tone(int freq, int duration){
+  playTone(freq, duration);
+}
+
+void FED3::stopTone(){
+  stopAudio();
+}
+
+
+void FED3::Noise(int duration) {
+  // White noise to signal errors
+  playNoise(duration);
+}
+
+//Queue a cue; all of these return immediately and the cues play back-to-back
+bool FED3::playTone(uint16_t freq, uint32_t durationMs) {
+  return queueAudio(AUDIO_TONE, freq, freq, durationMs);
+}
+
+bool FED3::playSweep(uint16_t fromFreq, uint16_t toFreq, uint32_t durationMs) {
+  return queueAudio(AUDIO_SWEEP, fromFreq, toFreq, durationMs);
+}
+
+//durationMs 0 plays until stopAudio() or the next cue
+bool FED3::playNoise(uint32_t durationMs, bool pink) {
+  return queueAudio(pink ? AUDIO_PINK : AUDIO_WHITE, 0, 0, durationMs);
+}
+
+bool FED3::playSilence(uint32_t durationMs) {
+  return queueAudio(AUDIO_SILENCE, 0, 0, durationMs);
+}
+
+bool FED3::queueAudio(uint8_t type, uint16_t freq, uint16_t toFreq, uint32_t durationMs) {
+  uint8_t next = (audioQueueHead + 1) % AUDIO_QUEUE_SIZE;
+  if (next == audioQueueTail) {
+    audioCuesDropped++;
+    return false;
+  }
+  AudioCue &cue = audioQueue[audioQueueHead];
+  cue.type = type;
+  cue.volume = audioVolume;
+  cue.samples = durationMs * (AUDIO_SAMPLE_RATE / 1000);
+  cue.increment = ((uint64_t)freq << 32) / AUDIO_SAMPLE_RATE;
+  uint32_t endIncrement = ((uint64_t)toFreq << 32) / AUDIO_SAMPLE_RATE;
+  cue.slope = cue.samples ? ((int64_t)endIncrement - (int64_t)cue.increment) / (int64_t)cue.samples : 0;
+  audioQueueHead = next;
+
+  noInterrupts();
+  if (!audioRunning) {
+    audioRunning = true;
+    audio.samplesLeft = 0;
+    audio.endless = false;
+    analogWriteFrequency(BUZZER, AUDIO_PWM_FREQ);
+    audioTimerBegin();
+  }
+  interrupts();
+  return true;
+}
+
+//Drop the queue and silence the buzzer at the next sample
+void FED3::stopAudio() {
+  noInterrupts();
+  audioQueueTail = audioQueueHead;
+  audio.samplesLeft = 0;
+  audio.endless = false;
+  interrupts();
+}
+
+bool FED3::audioBusy() {
+  return audioRunning;
+}
+
+//Audio timer: one sample per call
+void FED3::audioTick() {
+  if (audio.samplesLeft == 0 && (!audio.endless || audioQueueTail != audioQueueHead)) {
+    if (audioQueueTail == audioQueueHead) {
+      analogWrite(BUZZER, 0);
+      audioTimerEnd();
+      audioRunning = false;
+      return;
+    }
+    audio.cue = audioQueue[audioQueueTail];
+    audioQueueTail = (audioQueueTail + 1) % AUDIO_QUEUE_SIZE;
+    audio.samplesLeft = audio.cue.samples;
+    audio.endless = (audio.cue.samples == 0);
+    audio.phase = 0;
+    audio.increment = audio.cue.increment;
+  }
+
+  uint32_t sample = 0;
+  switch (audio.cue.type) {
+    case AUDIO_TONE:
+    case AUDIO_SWEEP:
+      sample = (audio.phase & 0x80000000) ? audio.cue.volume : 0;
+      audio.phase += audio.increment;
+      audio.increment += audio.cue.slope;
+      break;
+    case AUDIO_WHITE:
+      audio.noise ^= audio.noise << 13;
+      audio.noise ^= audio.noise >> 17;
+      audio.noise ^= audio.noise << 5;
+      sample = ((audio.noise & 0xFF) * audio.cue.volume) >> 8;
+      break;
+    case AUDIO_PINK: {
+      audio.noise ^= audio.noise << 13;
+      audio.noise ^= audio.noise >> 17;
+      audio.noise ^= audio.noise << 5;
+      uint8_t row = __builtin_ctz(++audio.pinkCounter | 0x80);   //row k changes every 2^k samples
+      audio.pinkSum -= audio.pinkRows[row];
+      audio.pinkRows[row] = audio.noise & 0x1F;
+      audio.pinkSum += audio.pinkRows[row];
+      sample = (audio.pinkSum * audio.cue.volume) >> 8;          //8 rows of 0-31
+      break;
+    }
+  }
+  analogWrite(BUZZER, sample);
+  if (audio.samplesLeft > 0) audio.samplesLeft--;
+}
+
+//The strip's pixel buffer is the framebuffer: the functions below only change it and mark it
+//dirty, and showLEDs() pushes the whole frame with a single strip.show()
+
+//Turn all pixels on to a specific color
+void FED3::pixelsOn(int R, int G, int B, int W) {
+  setPixels(0, 8, strip.Color(R, G, B, W), DRIVER_BOTH);
+  showLEDs();
 }
 
 //Turn all pixels off
 void FED3::pixelsOff() {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);
-  delay (2); //let things settle
-    for (uint16_t i = 0; i < strip.numPixels(); i++) {
-    strip.setPixelColor(i, 0,0,0,0);
-    strip.show();   
+  stopLEDEffect();
+  setPixels(0, strip.numPixels(), 0, DRIVER_BOTH);
+  showLEDs();
+}
+
+//colorWipe does a color wipe from left to right.  Blocks until the wipe is done, use
+//startColorWipe() to run it in the background
+void FED3::colorWipe(uint32_t c, uint8_t wait) {
+  startColorWipe(c, wait);
+  while (ledEffectActive()) serviceLEDs();
+  showLEDs();
+}
+
+// Visual tracking stimulus - left-most pixel on strip
+void FED3::leftPixel(int R, int G, int B, int W) {
+  setPixels(0, 1, strip.Color(R, G, B, W), DRIVER_LEFT);
+  showLEDs();
+}
+
+// Visual tracking stimulus - left-most pixel on strip
+void FED3::rightPixel(int R, int G, int B, int W) {
+  setPixels(7, 1, strip.Color(R, G, B, W), DRIVER_RIGHT);
+  showLEDs();
+}
+
+// Visual tracking stimulus - left poke pixel
+void FED3::leftPokePixel(int R, int G, int B, int W) {
+  setPixels(9, 1, strip.Color(R, G, B, W), DRIVER_LEFT);
+  showLEDs();
+}
+
+// Visual tracking stimulus - right poke pixel
+void FED3::rightPokePixel(int R, int G, int B, int W) {
+  setPixels(8, 1, strip.Color(R, G, B, W), DRIVER_RIGHT);
+  showLEDs();
+}
+
+//Change pixels in the framebuffer and power the drivers they hang off
+void FED3::setPixels(uint16_t first, uint16_t count, uint32_t c, uint8_t drivers) {
+  if constexpr (!TBConfig::neopixels) return;
+  for (uint16_t i = first; i < first + count && i < strip.numPixels(); i++) {
+    strip.setPixelColor(i, c);
+  }
+  claimDriverPower(drivers, POWER_LEDS);
+  ledDrivers |= drivers;
+  ledDirty = true;
+}
+
+//Push the framebuffer if it changed.  Right after a driver was switched on the pixels need
+//DRIVER_SETTLE_MICROS: wait it out, or with wait = false leave the frame for serviceLEDs().
+//Once a dark frame has been shown the LEDs give up their claim on the drivers
+void FED3::showLEDs(bool wait) {
+  if (!TBConfig::neopixels || !ledDirty) return;
+  if (!driverPowerSettled(ledDrivers)) {
+    if (!wait) return;
+    uint32_t start = micros();
+    while (!driverPowerSettled(ledDrivers)) {
+      if (micros() - start > DRIVER_SETTLE_MICROS) return;  //driver not on, serviceLEDs() retries
+    }
+  }
+  strip.show();
+  ledDirty = false;
+  const uint8_t *pixels = strip.getPixels();
+  for (uint16_t i = 0; i < strip.numPixels() * 4; i++) {
+    if (pixels[i] != 0) return;
+  }
+  releaseDriverPower(ledDrivers, POWER_LEDS);
+  ledDrivers = 0;
+}
+
+//Advance the running effect and push the frame, never blocks
+void FED3::serviceLEDs() {
+  if constexpr (!TBConfig::neopixels) return;
+  LEDEffect &e = ledEffect;
+  if (e.type != LED_EFFECT_NONE && (long)(millis() - e.next) >= 0) {
+    switch (e.type) {
+      case LED_EFFECT_WIPE:
+        setPixels(e.index++, 1, e.color, DRIVER_BOTH);
+        e.next += e.onMs;
+        break;
+      case LED_EFFECT_BLINK:
+        setPixels(0, 8, (e.stepsLeft & 1) ? 0 : e.color, DRIVER_BOTH);
+        e.next += (e.stepsLeft & 1) ? e.offMs : e.onMs;
+        break;
+      case LED_EFFECT_CUE:
+        setPixels(0, 8, 0, DRIVER_BOTH);
+        break;
+    }
+    if (--e.stepsLeft == 0) e.type = LED_EFFECT_NONE;
+  }
+  showLEDs(false);
+}
+
+//Wipe a color across the 8 pixels, one pixel every "wait" ms
+void FED3::startColorWipe(uint32_t c, uint16_t wait) {
+  ledEffect = {LED_EFFECT_WIPE, c, wait, 0, 8, 0, millis()};
+  serviceLEDs();
+}
+
+//Blink the 8 pixels "blinks" times
+void FED3::startBlink(uint32_t c, uint16_t onMs, uint16_t offMs, uint16_t blinks) {
+  if (blinks == 0) return;
+  ledEffect = {LED_EFFECT_BLINK, c, onMs, offMs, 2 * (uint32_t)blinks, 0, millis()};
+  serviceLEDs();
+}
+
+//Light the 8 pixels now and turn them off after durationMs
+void FED3::cueLight(uint32_t c, uint32_t durationMs) {
+  setPixels(0, 8, c, DRIVER_BOTH);
+  showLEDs();
+  ledEffect = {LED_EFFECT_CUE, c, 0, 0, 1, 0, millis() + durationMs};
+}
+
+void FED3::stopLEDEffect() {
+  ledEffect.type = LED_EFFECT_NONE;
+}
+
+bool FED3::ledEffectActive() {
+  return ledEffect.type != LED_EFFECT_NONE;
+}
+
+//The enable pins are shared by the motors and the NeoPixels: a pin is high while any user
+//holds it, so releasing the motor no longer blanks a cue light and vice versa
+void FED3::claimDriverPower(uint8_t drivers, uint8_t user) {
+  const uint8_t pins[2] = {MOTOR_ENABLE_LEFT, MOTOR_ENABLE_RIGHT};
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!(drivers & (1 << i))) continue;
+    if (driverPowerUsers[i] == 0) {
+      digitalWrite(pins[i], HIGH);
+      driverPowerOnMicros[i] = micros();
+    }
+    driverPowerUsers[i] |= user;
+  }
+}
+
+void FED3::releaseDriverPower(uint8_t drivers, uint8_t user) {
+  const uint8_t pins[2] = {MOTOR_ENABLE_LEFT, MOTOR_ENABLE_RIGHT};
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!(drivers & (1 << i)) || driverPowerUsers[i] == 0) continue;
+    driverPowerUsers[i] &= ~user;
+    if (driverPowerUsers[i] == 0) digitalWrite(pins[i], LOW);
+  }
+}
+
+bool FED3::driverPowerSettled(uint8_t drivers) {
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!(drivers & (1 << i))) continue;
+    if (driverPowerUsers[i] == 0 || micros() - driverPowerOnMicros[i] < DRIVER_SETTLE_MICROS) return false;
+  }
+  return true;
+}
+
+//Short helper function for blinking LEDs and BNC out port
+void FED3::Blink(byte PIN, byte DELAY_MS, byte loops) {
+  for (byte i = 0; i < loops; i++)  {
+    digitalWrite(PIN, HIGH);
+    delay(DELAY_MS);
+    digitalWrite(PIN, LOW);
+    delay(DELAY_MS);
+  }
+}
+
+//Simple function for sending square wave pulses to the BNC port.  Returns immediately, the
+//pulse-train engine produces the pulses in the background
+void FED3::BNC(int DELAY_MS, int loops) {
+  if (DELAY_MS <= 0 || loops <= 0) return;
+  if (!startPulseTrain((uint32_t)DELAY_MS * 1000, (uint32_t)DELAY_MS * 2000, loops)) {
+    Event = "BNCPulseRefused";          //line is an input, or a sync barcode has it
+    logdata();
+  }
+}
+
+//More advanced function for controlling pulse width and frequency for the BNC port.  Returns immediately
+void FED3::pulseGenerator(int pulse_width, int frequency, int repetitions){  // freq in Hz, width in ms, loops in number of times
+  if (pulse_width <= 0 || frequency <= 0 || repetitions <= 0) return;
+  uint32_t period = 1000000UL / frequency;
+  uint32_t width = (uint32_t)pulse_width * 1000;
+  if (period < width) period = width;  //if the parameters are set wrong, run the pulses back to back so FED3 doesn't crash O_o
+  if (!startPulseTrain(width, period, repetitions)) {
+    Event = "BNCPulseRefused";
+    logdata();
+  }
+}
+
+// Start a pulse train on BNC_OUT with µs timing: "pulses" pulses of "widthMicros" every
+// "periodMicros" form a burst, bursts start every "burstPeriodMicros".  bursts == 0 repeats
+// until stopPulseTrain().  Starting a train stops the one already running, unless that one is a
+// sync pulse or barcode: then it returns false.  The train state is
+// shared with the PIT and I2C interrupts, so it is only changed with interrupts off
+bool FED3::startPulseTrain(uint32_t widthMicros, uint32_t periodMicros, uint32_t pulses, uint32_t bursts, uint32_t burstPeriodMicros) {
+  if (widthMicros == 0 || pulses == 0 || bncMode != BNC_MODE_OUTPUT) return false;
+  if (periodMicros <= widthMicros) periodMicros = widthMicros + 1;
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  if (pulseTrain.active && pulseTrain.sync) {
+    if (!primask) __enable_irq();
+    return false;                        //a barcode that is cut short would misalign the recording
+  }
+  endPulseTrain();
+  pulseTrain.sync = false;
+  pulseTrain.width = widthMicros;
+  pulseTrain.period = periodMicros;
+  pulseTrain.pulses = pulses;
+  pulseTrain.pulsesLeft = pulses;
+  uint32_t burstLength = (pulses - 1) * periodMicros + widthMicros;
+  pulseTrain.burstLow = (burstPeriodMicros > burstLength) ? burstPeriodMicros - burstLength : periodMicros - widthMicros;
+  pulseTrain.bursts = bursts;
+  pulseTrain.burstsLeft = bursts;
+  pulseTrain.patternLength = 0;
+  pulseTrain.led = pulseTrainLED;
+  startPulseSegment(widthMicros);
+  if (!primask) __enable_irq();
+  return true;
+}
+
+// Start a patterned train: durations[] holds alternating high and low times in µs, starting
+// with high.  The pattern plays "repeats" times, 0 repeats until stopPulseTrain()
+bool FED3::startPulsePattern(const uint32_t *durations, uint8_t count, uint32_t repeats) {
+  if (count == 0 || count > PULSE_PATTERN_MAX || bncMode != BNC_MODE_OUTPUT) return false;
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  if (pulseTrain.active && pulseTrain.sync) {
+    if (!primask) __enable_irq();
+    return false;                        //a barcode that is cut short would misalign the recording
+  }
+  endPulseTrain();
+  pulseTrain.sync = false;
+  for (uint8_t i = 0; i < count; i++) {
+    pulseTrain.pattern[i] = max(durations[i], (uint32_t)1);
+  }
+  pulseTrain.patternLength = count;
+  pulseTrain.patternIndex = 0;
+  pulseTrain.repeatsLeft = repeats;
+  pulseTrain.repeatForever = (repeats == 0);
+  pulseTrain.led = pulseTrainLED;
+  startPulseSegment(pulseTrain.pattern[0]);
+  if (!primask) __enable_irq();
+  return true;
+}
+
+//Raise the output for the first segment and start the timer
+void FED3::startPulseSegment(uint32_t micros) {
+  pulseTrain.high = true;
+  pulseTrain.active = true;
+  digitalWriteFast(BNC_OUT, HIGH);
+  pulseTrainStartTime = clockMicros();
+  if (pulseTrain.led) digitalWriteFast(GREEN_LED, HIGH);
+  pulseTimer.begin(outsidePulseTrainHandler, micros);
+}
+
+void FED3::stopPulseTrain() {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  bool cutSync = pulseTrain.active && pulseTrain.sync;
+  endPulseTrain();
+  if (!primask) __enable_irq();
+  if (cutSync) {                        //flag the last logged sync as incomplete
+    char msg[32];
+    snprintf(msg, sizeof(msg), "SyncCut:%lu", (unsigned long)(syncCount - 1));
+    Event = msg;
+    logdata();
+  }
+}
+
+//Stop the timer and drop the line; the caller has interrupts off
+void FED3::endPulseTrain() {
+  pulseTimer.end();
+  if (bncMode == BNC_MODE_OUTPUT) digitalWriteFast(BNC_OUT, LOW);
+  if (pulseTrain.led) digitalWriteFast(GREEN_LED, LOW);
+  pulseTrain.active = false;
+}
+
+bool FED3::pulseTrainActive() {
+  return pulseTrain.active;
+}
+
+//Timer interrupt: end the current segment and start the next one
+void FED3::pulseTrainTick() {
+  __disable_irq();                      //the I2C interrupt can preempt the PIT, keep the step whole
+  PulseTrain &t = pulseTrain;
+  uint32_t next;
+  if (t.patternLength > 0) {
+    if (++t.patternIndex == t.patternLength) {
+      t.patternIndex = 0;
+      if (!t.repeatForever && --t.repeatsLeft == 0) {
+        endPulseTrain();
+        __enable_irq();
+        return;
+      }
+    }
+    t.high = (t.patternIndex % 2 == 0);
+    next = t.pattern[t.patternIndex];
+  }
+  else if (t.high) {
+    t.high = false;
+    if (--t.pulsesLeft > 0) {
+      next = t.period - t.width;
+    }
+    else {
+      if (t.bursts != 0 && --t.burstsLeft == 0) {
+        endPulseTrain();
+        __enable_irq();
+        return;
+      }
+      t.pulsesLeft = t.pulses;
+      next = t.burstLow;
+    }
   }
-  digitalWrite (MOTOR_ENABLE_LEFT, LOW);
-  digitalWrite (MOTOR_ENABLE_RIGHT, LOW);
-  //disable motor driver and neopixels
-}
-
-//colorWipe does a color wipe from left to right
-void FED3::colorWipe(uint32_t c, uint8_t wait) {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);
-  delay(2); //let things settle
-  for (uint16_t i = 0; i < 8; i++) {
-    strip.setPixelColor(i, c);
-    strip.show();
-    delay(wait);
+  else {
+    t.high = true;
+    next = t.width;
   }
-  digitalWrite (MOTOR_ENABLE_LEFT, LOW);
-  digitalWrite (MOTOR_ENABLE_RIGHT, LOW);
-  //disable motor driver and neopixels
-  delay(2); //let things settle
+  digitalWriteFast(BNC_OUT, t.high ? HIGH : LOW);
+  if (t.led) digitalWriteFast(GREEN_LED, t.high ? HIGH : LOW);
+  pulseTimer.begin(outsidePulseTrainHandler, next);
+  __enable_irq();
 }
 
-// Visual tracking stimulus - left-most pixel on strip
-void FED3::leftPixel(int R, int G, int B, int W) {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);
-  delay(2); //let things settle
-  strip.setPixelColor(0, R, G, B, W);
-  strip.show();
-//   delay(2); //let things settle
+// Periodic sync output on BNC_OUT for aligning the log with photometry/ephys recordings.
+// SYNC_PULSE sends one syncBitMicros pulse every intervalMs.  SYNC_BARCODE sends a
+// start marker (2 bits high, 1 low) followed by a 32-bit counter, LSB first, one syncBitMicros
+// per bit (high = 1).  The device time of every rising start edge is logged.
+void FED3::startSync(uint8_t mode, uint32_t intervalMs) {
+  syncMode = mode;
+  syncInterval = intervalMs;
+  lastSync = millis() - intervalMs;  //first one goes out right away
 }
 
-// Visual tracking stimulus - left-most pixel on strip
-void FED3::rightPixel(int R, int G, int B, int W) {
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);
-  delay(2); //let things settle
-  strip.setPixelColor(7, R, G, B, W);
-  strip.show();
-//   delay(2); //let things settle
+void FED3::stopSync() {
+  syncMode = SYNC_OFF;
 }
 
-// Visual tracking stimulus - left poke pixel
-void FED3::leftPokePixel(int R, int G, int B, int W) {
-  digitalWrite (MOTOR_ENABLE_LEFT, HIGH);
-  delay(2); //let things settle
-  strip.setPixelColor(9, R, G, B, W);
-  strip.show();
-//   delay(2); //let things settle
-}
+void FED3::serviceSync() {
+  if (syncMode == SYNC_OFF || bncMode != BNC_MODE_OUTPUT) return;
+  if (millis() - lastSync < syncInterval) return;
+  if (pulseTrainActive()) return;  //another train owns the output, go as soon as it is done
 
-// Visual tracking stimulus - right poke pixel
-void FED3::rightPokePixel(int R, int G, int B, int W) {
-  digitalWrite (MOTOR_ENABLE_RIGHT, HIGH);
-  delay(2); //let things settle
-  strip.setPixelColor(8, R, G, B, W);
-  strip.show();
-  //delay(2); //let things settle
+  bool started;
+  if (syncMode == SYNC_PULSE) {
+    started = startPulseTrain(syncBitMicros, syncBitMicros + 1, 1);
+  }
+  else {
+    // bit sequence: start marker 1,1,0 then the counter, then back to low
+    uint32_t runs[PULSE_PATTERN_MAX];
+    uint8_t count = 0;
+    bool level = true;
+    uint32_t run = 0;
+    for (int i = -3; i < 33; i++) {
+      bool bit;
+      if (i < -1) bit = true;
+      else if (i == -1 || i == 32) bit = false;
+      else bit = (syncCount >> i) & 1;
+      if (bit != level) {
+        runs[count++] = run;
+        level = bit;
+        run = 0;
+      }
+      run += syncBitMicros;
+    }
+    runs[count++] = run;
+    started = startPulsePattern(runs, count, 1);
+  }
+  if (!started) return;
+  pulseTrain.sync = true;               //no other train may cut it short now
+  lastSync = millis();
+
+  char msg[48];
+  if (syncMode == SYNC_PULSE) {
+    snprintf(msg, sizeof(msg), "SyncPulse:%lu:t=%lu.%06lus", (unsigned long)syncCount,
+             (unsigned long)(pulseTrainStartTime / 1000000), (unsigned long)(pulseTrainStartTime % 1000000));
+  }
+  else {
+    snprintf(msg, sizeof(msg), "SyncBarcode:%lu:t=%lu.%06lus", (unsigned long)syncCount,
+             (unsigned long)(pulseTrainStartTime / 1000000), (unsigned long)(pulseTrainStartTime % 1000000));
+  }
+  syncCount++;
+  eventTime = pulseTrainStartTime;
+  Event = msg;
+  logdata();
 }
 
-//Short helper function for blinking LEDs and BNC out port
-void FED3::Blink(byte PIN, byte DELAY_MS, byte loops) {
-  for (byte i = 0; i < loops; i++)  {
-    digitalWrite(PIN, HIGH);
-    delay(DELAY_MS);
-    digitalWrite(PIN, LOW);
-    delay(DELAY_MS);
+//Switch the BNC line between TTL output and timestamped input capture
+void FED3::setBNCMode(uint8_t mode) {
+  if (mode == bncMode) return;
+  if (mode == BNC_MODE_INPUT) {
+    stopPulseTrain();
+    bncMode = BNC_MODE_INPUT;
+    pinMode(BNC_OUT, INPUT_PULLDOWN);
+    bncQueueHead = bncQueueTail = 0;
+    attachInterrupt(digitalPinToInterrupt(BNC_OUT), outsideBNCHandler, CHANGE);
+  }
+  else {
+    detachInterrupt(digitalPinToInterrupt(BNC_OUT));
+    bncMode = BNC_MODE_OUTPUT;
+    pinMode(BNC_OUT, OUTPUT);
+    digitalWrite(BNC_OUT, LOW);
   }
 }
 
-//Simple function for sending square wave pulses to the BNC port
-void FED3::BNC(int DELAY_MS, int loops) {
-  for (int i = 0; i < loops; i++)  {
-    digitalWrite(BNC_OUT, HIGH);
-    digitalWrite(GREEN_LED, HIGH);
-    delay(DELAY_MS);
-    digitalWrite(BNC_OUT, LOW);
-    digitalWrite(GREEN_LED, LOW);
-    delay(DELAY_MS);
+//Pin interrupt in input mode: queue the edge with its timestamp
+void FED3::bncEdge() {
+  uint64_t t = clockMicros();
+  uint8_t next = (bncQueueHead + 1) % BNC_QUEUE_SIZE;
+  if (next == bncQueueTail) {
+    bncEdgesLost++;
+    return;
   }
+  bncQueue[bncQueueHead].rising = (digitalReadFast(BNC_OUT) == HIGH);
+  bncQueue[bncQueueHead].time = t;
+  bncQueueHead = next;
 }
 
-//More advanced function for controlling pulse width and frequency for the BNC port
-void FED3::pulseGenerator(int pulse_width, int frequency, int repetitions){  // freq in Hz, width in ms, loops in number of times
-  for (byte j = 0; j < repetitions; j++) {
-    digitalWrite(BNC_OUT, HIGH);
-    digitalWrite(GREEN_LED, HIGH);
-    delay(pulse_width);  //pulse high for width
-    digitalWrite(BNC_OUT, LOW);
-    digitalWrite(GREEN_LED, LOW);
-    long temp_delay = (1000 / frequency) - pulse_width;
-    if (temp_delay < 0) temp_delay = 0;  //if temp delay <0 because parameters are set wrong, set it to 0 so FED3 doesn't crash O_o
-    delay(temp_delay); //pin low
+//Log the captured edges, each stamped with the time it happened rather than when it is written
+void FED3::serviceBNC() {
+  while (bncQueueTail != bncQueueHead) {
+    BNCEdge e = bncQueue[bncQueueTail];
+    bncQueueTail = (bncQueueTail + 1) % BNC_QUEUE_SIZE;
+    BNCinput = e.rising;
+    eventTime = e.time;
+    Event = e.rising ? "BNCRise" : "BNCFall";
+    logdata();
   }
 }
 
+//Read the BNC line as an input.  An output line is switched to input for the read and back
+//afterwards, so BNC() keeps working; use setBNCMode() to capture edges instead.  While a pulse
+//train is driving the line the read is skipped and BNCinput keeps its last value
 void FED3::ReadBNC(bool blinkGreen){
-    pinMode(BNC_OUT, INPUT_PULLDOWN);
-    BNCinput=false;
-    if (digitalRead(BNC_OUT) == HIGH)
-    {
-      delay (1);
-      if (digitalRead(BNC_OUT) == HIGH)
-      {
-        if (blinkGreen == true)
-        {
-          digitalWrite(GREEN_LED, HIGH);
-          delay (25);
-          digitalWrite(GREEN_LED, LOW);
-        }
-        BNCinput=true;
+    if (bncMode == BNC_MODE_OUTPUT) {
+      noInterrupts();                   //no train may start from an interrupt mid-read
+      if (pulseTrain.active) {
+        interrupts();
+        return;
       }
+      pinMode(BNC_OUT, INPUT_PULLDOWN);
+      delayMicroseconds(10);            //let the pulldown settle
+      BNCinput = (digitalReadFast(BNC_OUT) == HIGH);
+      pinMode(BNC_OUT, OUTPUT);
+      digitalWrite(BNC_OUT, LOW);
+      interrupts();
+    }
+    else BNCinput = (digitalReadFast(BNC_OUT) == HIGH);
+    if (BNCinput && blinkGreen == true)
+    {
+      digitalWrite(GREEN_LED, HIGH);
+      delay (25);
+      digitalWrite(GREEN_LED, LOW);
     }
 }
 
@@ -574,6 +2837,7 @@ void FED3::ReadBNC(bool blinkGreen){
                                                                                                Display functions
 **************************************************************************************************************************************************/
 void FED3::UpdateDisplay() {
+  if constexpr (!TBConfig::display) return;
   //Box around data area of screen
   display.drawRect (5, 45, 158, 70, BLACK);
   
@@ -606,6 +2870,15 @@ void FED3::UpdateDisplay() {
   display.setCursor(120, 85);
   display.print(RightLickCount);
   
+  display.setFont(&Org_01);             //bout counts under the lick counts
+  display.setCursor(95, 73);
+  display.print("bouts ");
+  display.print(boutCount(SIDE_LEFT));
+  display.setCursor(95, 93);
+  display.print("bouts ");
+  display.print(boutCount(SIDE_RIGHT));
+  display.setFont(&FreeSans9pt7b);
+
   display.setCursor(35, 105);
   display.print("TotalDeli:");
   display.setCursor(120, 105);
@@ -622,6 +2895,7 @@ void FED3::UpdateDisplay() {
 }
 
 void FED3::DisplayDateTime(){
+  if constexpr (!TBConfig::display) return;
   // Print date and time at bottom of the screen
   time_t nowTime = now();
   display.setCursor(0, 135);
@@ -642,6 +2916,7 @@ void FED3::DisplayDateTime(){
 }
 
 void FED3::DisplayIndicators(){
+  if constexpr (!TBConfig::display) return;
   // Pellet circle
   display.fillCircle(25, 99, 5, WHITE); //pellet
   display.drawCircle(25, 99, 5, BLACK);
@@ -661,6 +2936,7 @@ void FED3::DisplayIndicators(){
 }
 
 void FED3::DisplayBattery(){
+  if constexpr (!TBConfig::display) return;
   //  Battery graphic showing bars indicating voltage levels
   if ((numMotorTurnsLeft + numMotorTurnsRight) == 0) {
     display.fillRect (117, 2, 40, 16, WHITE);
@@ -707,7 +2983,7 @@ void FED3::DisplayBattery(){
   display.setTextSize(1);
   
   //display temp/humidity sensor indicator if present
-  if (tempSensor == true){
+  if (TBConfig::aht20 && tempSensor){
     display.setTextSize(1);
     display.setFont(&Org_01);
     display.setCursor(89, 18);
@@ -719,6 +2995,7 @@ void FED3::DisplayBattery(){
 
 //Display "Check SD Card!" if there is a card error
 void FED3::DisplaySDError() {
+  if constexpr (!TBConfig::display) return;
   display.clearDisplay();
   display.setCursor(20, 40);
   display.println("   Check");
@@ -729,6 +3006,7 @@ void FED3::DisplaySDError() {
 
 //Display text when FED is clearing a jam
 void FED3::DisplayJamClear() {
+  if constexpr (!TBConfig::display) return;
   display.fillRect (6, 20, 200, 22, WHITE);  //erase the data on screen without clearing the entire screen by pasting a white box over it
   display.setCursor(6, 36);
   display.print("Clearing jam");
@@ -737,6 +3015,7 @@ void FED3::DisplayJamClear() {
 
 //Display text when FED is clearing a jam
 void FED3::DisplayJammed() {
+  if constexpr (!TBConfig::display) return;
   display.clearDisplay();
   display.fillRect (6, 20, 200, 22, WHITE);  //erase the data on screen without clearing the entire screen by pasting a white box over it
   display.setCursor(6, 36);
@@ -750,6 +3029,7 @@ void FED3::DisplayJammed() {
 
 //Display pellet retrieval interval
 void FED3::DisplayRetrievalInt() {
+  if constexpr (!TBConfig::display) return;
   display.fillRect (85, 22, 70, 15, WHITE); 
   display.setCursor(90, 36);
   if (retInterval<59000){
@@ -761,6 +3041,7 @@ void FED3::DisplayRetrievalInt() {
 
 //Display left poke duration
 void FED3::DisplayLeftInt() {
+  if constexpr (!TBConfig::display) return;
   display.fillRect (85, 22, 70, 15, WHITE);  
   display.setCursor(90, 36);
   if (leftInterval<10000){
@@ -772,6 +3053,7 @@ void FED3::DisplayLeftInt() {
 
 //Display right poke duration
 void FED3::DisplayRightInt() {
+  if constexpr (!TBConfig::display) return;
   display.fillRect (85, 22, 70, 15, WHITE);  
   display.setCursor(90, 36);
   if (rightInterval<10000){
@@ -782,6 +3064,7 @@ void FED3::DisplayRightInt() {
 }
 
 void FED3::StartScreen(){
+  if constexpr (!TBConfig::display) return;
   if (ClassicFED3==false){
     display.setTextSize(3);
     display.setTextColor(BLACK);
@@ -813,6 +3096,7 @@ void FED3::StartScreen(){
 }
 
 void FED3::DisplayTimedFeeding(){
+  if constexpr (!TBConfig::display) return;
   display.setCursor(35, 65);
   display.print (timedStart);
   display.print (":00 to ");
@@ -821,6 +3105,7 @@ void FED3::DisplayTimedFeeding(){
 }
 
 void FED3::DisplayMinPoke(){
+  if constexpr (!TBConfig::display) return;
   display.setCursor(115, 65);
   display.print ((minPokeTime/1000.0),1);
   display.print ("s");
@@ -828,6 +3113,7 @@ void FED3::DisplayMinPoke(){
 }
 
 void FED3::DisplayNoProgram(){
+  if constexpr (!TBConfig::display) return;
   display.clearDisplay();
   display.setCursor(15, 45);
   display.print ("No program");
@@ -846,6 +3132,7 @@ void FED3::DisplayNoProgram(){
 }
 
 void FED3::DisplayMouse() {
+  if constexpr (!TBConfig::display) return;
   static uint32_t bothLowSince = 0;     // remembers when both pokes first went LOW
   //Draw animated mouse...
   for (int i = -50; i < 200; i += 15) {
@@ -872,23 +3159,25 @@ void FED3::DisplayMouse() {
       display.fillRoundRect (i + 8, 97, 8, 6, 3, BLACK);     //back foot
     }
     display.refresh();
+    enterSection(SECTION_MENU);
+    watchdogService();
     delay (80);
     display.fillRect (i-25, 73, 95, 33, WHITE);
     previousFEDmode = FEDmode;
     previousFED = FED;
     
     // If one poke is pushed change mode
-    if (FED3Menu == true or ClassicFED3 == true or psygene){
+    if (TBConfig::menu && (FED3Menu == true or ClassicFED3 == true or psygene)){
       if (digitalRead (LEFT_POKE) == LOW || digitalRead (RIGHT_POKE) == LOW) SelectMode();
     }
     
     // If both pokes are pushed edit device number
-    if (digitalRead(LEFT_POKE)  == LOW && digitalRead(RIGHT_POKE) == LOW) {
+    if (TBConfig::menu && digitalRead(LEFT_POKE)  == LOW && digitalRead(RIGHT_POKE) == LOW) {
       if (bothLowSince == 0) bothLowSince = millis();          // start timer
       if (millis() - bothLowSince > 1500) {                    // 1.5-s hold
-        tone(BUZZER, 1000, 200);  delay(400);
-        tone(BUZZER, 1000, 500);  delay(200);
-        tone(BUZZER, 3000, 600);
+        playTone(1000, 200);  playSilence(200);
+        playTone(1000, 200);
+        playTone(3000, 600);
         colorWipe(strip.Color(2, 2, 2), 40);                 // white flash
         colorWipe(strip.Color(0, 0, 0), 20);                 // off
 
@@ -908,7 +3197,7 @@ void FED3::DisplayMouse() {
 // Create new files on uSD for FED3 settings
 void FED3::CreateFile() {
   Serial.println(F("→ CreateFile():SD. begin"));
-  digitalWrite (MOTOR_ENABLE, LOW);  //Disable motor driver and neopixel
+  releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //Disable motor driver
   // see if the card is present and can be initialized:
   #if defined(__IMXRT1062__)  // Teensy 4.0/4.1专用
   if (!SD.begin(SdioConfig(FIFO_SDIO))) {
@@ -977,7 +3266,7 @@ void FED3::CreateFile() {
 //Create a new datafile
 void FED3::CreateDataFile () {
   Serial.println(F("→ CreateDataFile():SD.open"));
-  digitalWrite (MOTOR_ENABLE, LOW);  //Disable motor driver and neopixel
+  releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //Disable motor driver
   getFilename(filename);
   Serial.print(F("filename = "));
   Serial.println(filename);
@@ -998,34 +3287,39 @@ void FED3::CreateDataFile () {
 
 //Write the header to the datafile
 void FED3::writeHeader() {
-  digitalWrite (MOTOR_ENABLE, LOW);  //Disable motor driver and neopixel
+  releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //Disable motor driver
   // Write data header to file of microSD card
 
-  if ((sessiontype == "Bandit") or (sessiontype == "Bandit80") or (sessiontype == "Bandit100")){
-    if (tempSensor == false) {
-      logfile.println("MM:DD:YYYY hh:mm:ss:ms,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,PelletsToSwitch,Prob_left,Prob_right,Event,High_prob_poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
+  if (banditSession()){
+    if (!TBConfig::aht20 || !tempSensor) {
+      logfile.print("MM:DD:YYYY hh:mm:ss:ms,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,PelletsToSwitch,Prob_left,Prob_right,Event,High_prob_poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
     }
-    else if (tempSensor == true) {
-      logfile.println("MM:DD:YYYY hh:mm:ss:ms,Temp,Humidity,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,PelletsToSwitch,Prob_left,Prob_right,Event,High_prob_poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
+    else if (TBConfig::aht20 && tempSensor) {
+      logfile.print("MM:DD:YYYY hh:mm:ss:ms,Temp,Humidity,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,PelletsToSwitch,Prob_left,Prob_right,Event,High_prob_poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
     }
   }
 
   else {
-    if (tempSensor == false){
-      logfile.println("MM:DD:YYYY hh:mm:ss:ms,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,FR,Event,Active_Poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
+    if (!TBConfig::aht20 || !tempSensor){
+      logfile.print("MM:DD:YYYY hh:mm:ss:ms,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,FR,Event,Active_Poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
     }
-    if (tempSensor == true){
-      logfile.println("MM:DD:YYYY hh:mm:ss:ms,Temp,Humidity,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,FR,Event,Active_Poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
+    if (TBConfig::aht20 && tempSensor){
+      logfile.print("MM:DD:YYYY hh:mm:ss:ms,Temp,Humidity,Library_Version,Session_type,Device_Number,Battery_Voltage,Left_Motor_Turns,Right_Motor_Turns,FR,Event,Active_Poke,Left_Poke_Count,Right_Poke_Count,Left_Lick_Count,Right_Lick_Count,Left_Deliver_Count,Right_Deliver_Count,Block_Pellet_Count,Retrieval_Time,InterPelletInterval,Poke_Time");
     }
   }
+  for (uint8_t ch = 2; ch < TB_CHANNELS; ch++) {   //extra channels of multi-bottle rigs
+    const char *n = channel[ch].name;
+    logfile.printf(",%s_Poke_Count,%s_Lick_Count,%s_Deliver_Count", n, n, n);
+  }
+  logfile.println(",Seq,CRC");
 
-
-  logfile.close();
+  logfile.flush();                       //the logfile stays open for the whole session
+  logSeq = 0;
 }
 
 //write a configfile (this contains the FED device number)
 void FED3::writeConfigFile() {
-  digitalWrite (MOTOR_ENABLE, LOW);  //Disable motor driver and neopixel
+  releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //Disable motor driver
   configfile = SD.open("DeviceNumber.csv", FILE_WRITE);
   configfile.seek(0);
   configfile.println(FED);
@@ -1035,180 +3329,152 @@ void FED3::writeConfigFile() {
 
 //Write to SD card
 void FED3::logdata() {
-  bool isDeliver = (Event == "LeftDeliver" || Event == "RightDeliver");
+  uint8_t section = enterSection(SECTION_LOGGING);
+  bool isDeliver = Event.endsWith("Deliver");
   if (EnableSleep==true){
-    digitalWrite (MOTOR_ENABLE, LOW);  //Disable motor driver and neopixel
+    releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //Disable motor driver
   }
-  SD.begin(SdioConfig(FIFO_SDIO));
-  
-  //fix filename (the .CSV extension can become corrupted) and open file
-  filename[16] = '.';
-  filename[17] = 'C';
-  filename[18] = 'S';
-  filename[19] = 'V';
-  logfile = SD.open(filename, FILE_WRITE);
+  record.clear();
 
-  //if FED3 cannot open file put SD card icon on screen 
-  display.fillRect (68, 1, 15, 22, WHITE); //clear a space
-  if ( ! logfile ) {
-  
-    //draw SD card icon
-    display.drawRect (70, 2, 11, 14, BLACK);
-    display.drawRect (69, 6, 2, 10, BLACK);
-    display.fillRect (70, 7, 4, 8, WHITE);
-    display.drawRect (72, 4, 1, 3, BLACK);
-    display.drawRect (74, 4, 1, 3, BLACK);
-    display.drawRect (76, 4, 1, 3, BLACK);
-    display.drawRect (78, 4, 1, 3, BLACK);
-    //exclamation point
-    display.fillRect (72, 6, 6, 16, WHITE);
-    display.setCursor(74, 16);
-    display.setTextSize(2);
-    display.setFont(&Org_01);
-    display.print("!");
-    display.setFont(&FreeSans9pt7b);
-    display.setTextSize(1);
-  }
-  
   /////////////////////////////////
   // Log data and time 
   /////////////////////////////////
-  time_t nowTime = now();
-  unsigned long msPart = millis() % 1000; // Get milliseconds part of the time
-  logfile.print(month(nowTime));
-  logfile.print("/");
-  logfile.print(day(nowTime));
-  logfile.print("/");
-  logfile.print(year(nowTime));
-  logfile.print(" ");
-  logfile.print(hour(nowTime));
-  logfile.print(":");
+  uint64_t t = (eventTime != 0 ? eventTime : clockMicros());  // events captured by interrupt keep their own time
+  uint64_t wall = t + wallOffsetAt(t);
+  eventTime = 0;
+  time_t nowTime = wall / 1000000;
+  unsigned long msPart = (wall / 1000) % 1000; // Get milliseconds part of the time
+  record.print(month(nowTime));
+  record.print("/");
+  record.print(day(nowTime));
+  record.print("/");
+  record.print(year(nowTime));
+  record.print(" ");
+  record.print(hour(nowTime));
+  record.print(":");
   if (minute(nowTime) < 10)
-    logfile.print('0');      // Trick to add leading zero for formatting
-  logfile.print(minute(nowTime));
-  logfile.print(":");
+    record.print('0');      // Trick to add leading zero for formatting
+  record.print(minute(nowTime));
+  record.print(":");
   if (second(nowTime) < 10)
-    logfile.print('0');      // Trick to add leading zero for formatting
-  logfile.print(second(nowTime));
-  logfile.print(":");
-  if (msPart < 100) logfile.print('0');
-  if (msPart <  10) logfile.print('0');
-  logfile.print(msPart);
-  logfile.print(",");
+    record.print('0');      // Trick to add leading zero for formatting
+  record.print(second(nowTime));
+  record.print(":");
+  if (msPart < 100) record.print('0');
+  if (msPart <  10) record.print('0');
+  record.print(msPart);
+  record.print(",");
     
   /////////////////////////////////
   // Log temp and humidity
   /////////////////////////////////
-  if (tempSensor == true){
-    sensors_event_t humidity, temp;
-    aht.getEvent(&humidity, &temp);// populate temp and humidity objects with fresh data
-    logfile.print (temp.temperature);
-    logfile.print(",");
-    logfile.print (humidity.relative_humidity);
-    logfile.print(",");
+  if (TBConfig::aht20 && tempSensor){
+    record.print (temperature);   // last sample taken by the environment task
+    record.print(",");
+    record.print (humidity);
+    record.print(",");
   }
 
   /////////////////////////////////
   // Log library version and Sketch identifier text
   /////////////////////////////////
-  logfile.print(VER); // Print library version
-  logfile.print(",");
+  record.print(VER); // Print library version
+  record.print(",");
   
   /////////////////////////////////
   // Log Trial Info
   /////////////////////////////////
-  logfile.print(sessiontype);  //print Sketch identifier
-  logfile.print(",");
+  record.print(sessiontype);  //print Sketch identifier
+  record.print(",");
   
   /////////////////////////////////
   // Log FED device number
   /////////////////////////////////
-  logfile.print(FED); // 
-  logfile.print(",");
+  record.print(FED); // 
+  record.print(",");
 
   /////////////////////////////////
   // Log battery voltage
   /////////////////////////////////
-  ReadBatteryLevel();
-  logfile.print(measuredvbat); // 
-  logfile.print(",");
+  record.print(measuredvbat); // sampled by the battery task
+  record.print(",");
 
   /////////////////////////////////
   // Log motor turns
   /////////////////////////////////
   if (!isDeliver) { // if it's not a pellet delivery event
-    logfile.print(sqrt (-1)); // print NaN if it's not a pellet Event
-    logfile.print(",");
-    logfile.print(sqrt (-1)); // print NaN if it's not a pellet Event
-    logfile.print(",");
+    record.print(sqrt (-1)); // print NaN if it's not a pellet Event
+    record.print(",");
+    record.print(sqrt (-1)); // print NaN if it's not a pellet Event
+    record.print(",");
   }
   else {
-    logfile.print(numMotorTurnsLeft+1); // Print the number of attempts to dispense a pellet
-    logfile.print(",");
-    logfile.print(numMotorTurnsRight+1);
-    logfile.print(",");
+    record.print(numMotorTurnsLeft+1); // Print the number of attempts to dispense a pellet
+    record.print(",");
+    record.print(numMotorTurnsRight+1);
+    record.print(",");
   }
 
   /////////////////////////////////////////////////////////////
   // Log FR ratio (or pellets to switch block in bandit task)
 
-  if ((sessiontype == "Bandit") or (sessiontype == "Bandit80") or (sessiontype == "Bandit100")) {
-    logfile.print(pelletsToSwitch);
-    logfile.print(",");
-    logfile.print(prob_left);
-    logfile.print(",");
-    logfile.print(prob_right);
-    logfile.print(",");
+  if (banditSession()) {
+    record.print(pelletsToSwitch);
+    record.print(",");
+    record.print(prob_left);
+    record.print(",");
+    record.print(prob_right);
+    record.print(",");
   }
   else {
-    logfile.print(FR);
-    logfile.print(",");
+    record.print(FR);
+    record.print(",");
   }
 
   /////////////////////////////////
   // Log event type (pellet, right, left)
   /////////////////////////////////
-  logfile.print(Event); 
-  logfile.print(",");
+  record.write((const uint8_t*)Event.c_str(), min(Event.length(), (unsigned int)LOG_EVENT_MAX));
+  record.print(",");
 
   /////////////////////////////////
   // Log Active poke side (left, right)
   /////////////////////////////////
-  if ((sessiontype == "Bandit") or (sessiontype == "Bandit80") or (sessiontype == "Bandit100")) {
-    if (prob_left > prob_right) logfile.print("Left");
-    else if (prob_left < prob_right) logfile.print("Right");
-    else if (prob_left == prob_right) logfile.print("nan");
+  if (banditSession()) {
+    if (prob_left > prob_right) record.print("Left");
+    else if (prob_left < prob_right) record.print("Right");
+    else if (prob_left == prob_right) record.print("nan");
   }
   
   else {
-    if (activePoke == 0)  logfile.print("Right"); //
-    if (activePoke == 1)  logfile.print("Left"); //
+    if (activePoke == 0)  record.print("Right"); //
+    if (activePoke == 1)  record.print("Left"); //
   }
 
-  logfile.print(",");
+  record.print(",");
 
 
   /////////////////////////////////
   // Log data (leftCount, RightCount, Pellets)
   /////////////////////////////////
-  logfile.print(LeftCount); // Print Left poke count
-  logfile.print(",");
+  record.print(LeftCount); // Print Left poke count
+  record.print(",");
     
-  logfile.print(RightCount); // Print Right poke count
-  logfile.print(",");
+  record.print(RightCount); // Print Right poke count
+  record.print(",");
 
-  logfile.print(LeftLickCount); // Print Left/right lick count
-  logfile.print(",");
-  logfile.print(RightLickCount);
-  logfile.print(",");
+  record.print(LeftLickCount); // Print Left/right lick count
+  record.print(",");
+  record.print(RightLickCount);
+  record.print(",");
 
-  logfile.print(LeftDeliverCount); // print left drop counts
-  logfile.print(",");
-  logfile.print(RightDeliverCount); // print right drop counts
-  logfile.print(",");
+  record.print(LeftDeliverCount); // print left drop counts
+  record.print(",");
+  record.print(RightDeliverCount); // print right drop counts
+  record.print(",");
 
-  logfile.print(BlockPelletCount); // print Block Pellet counts
-  logfile.print(",");
+  record.print(BlockPelletCount); // print Block Pellet counts
+  record.print(",");
 
   
 
@@ -1216,65 +3482,345 @@ void FED3::logdata() {
   // Log pellet retrieval interval
   /////////////////////////////////
   if (!isDeliver) { // if it's not a pellet delivery event
-    logfile.print(sqrt (-1)); // print NaN if it's not a pellet Event
+    record.print(sqrt (-1)); // print NaN if it's not a pellet Event
   }
   else if (retInterval < 60000 ) {  // only log retrieval intervals below 1 minute (FED should not record any longer than this)
-    logfile.print(retInterval/1000.000); // print interval between pellet dispensing and being taken
+    record.print(retInterval/1000.000); // print interval between pellet dispensing and being taken
   }
   else if (retInterval >= 60000) {
-    logfile.print("Timed_out"); // print "Timed_out" if retreival interval is >60s
+    record.print("Timed_out"); // print "Timed_out" if retreival interval is >60s
   }
   else {
-    logfile.print("Error"); // print error if value is < 0 (this shouldn't ever happen)
+    record.print("Error"); // print error if value is < 0 (this shouldn't ever happen)
   }
-  logfile.print(",");
+  record.print(",");
   
   
   /////////////////////////////////
   // Inter-Pellet-Interval
   /////////////////////////////////
   if ((!isDeliver) or (TotalDeliverCount < 2)){
-    logfile.print(sqrt (-1)); // print NaN if it's not a pellet Event
+    record.print(sqrt (-1)); // print NaN if it's not a pellet Event
   }
   else {
-    logfile.print (interPelletInterval);
+    record.print (interPelletInterval, 6);
   }
-  logfile.print(",");
+  record.print(",");
       
   /////////////////////////////////
   // Poke duration
   /////////////////////////////////
+  int8_t pokeCh;
   if (isDeliver){
-    logfile.println(sqrt (-1)); // print NaN 
+    record.print(sqrt (-1)); // print NaN 
+  }
+
+  else if ((Event == "Left") or (Event == "LeftPoke") or (Event == "LeftShort") or (Event == "LeftWithPellet") or (Event == "LeftinTimeout") or (Event == "LeftinTimeOut") or (Event == "LeftDuringDispense")) {  // 
+    record.print(leftIntervalMicros / 1000000.0, 6); // print left poke timing
   }
 
-  else if ((Event == "Left") or (Event == "LeftShort") or (Event == "LeftWithPellet") or (Event == "LeftinTimeout") or (Event == "LeftDuringDispense")) {  // 
-    logfile.println(leftInterval/1000.000); // print left poke timing
+  else if ((Event == "Right") or (Event == "RightPoke") or (Event == "RightShort") or (Event == "RightWithPellet") or (Event == "RightinTimeout") or (Event == "RightDuringDispense")) {  // 
+    record.print(rightIntervalMicros / 1000000.0, 6); // print right poke timing
   }
 
-  else if ((Event == "Right") or (Event == "RightShort") or (Event == "RightWithPellet") or (Event == "RightinTimeout") or (Event == "RightDuringDispense")) {  // 
-    logfile.println(rightInterval/1000.000); // print left poke timing
+  else if ((pokeCh = pokeEventChannel()) >= 2) {
+    record.print(channel[pokeCh].intervalMicros / 1000000.0, 6); // print extra channel poke timing
   }
   
   else {
-    logfile.println(sqrt (-1)); // print NaN 
+    record.print(sqrt (-1)); // print NaN 
   }
+  record.print(",");
 
   /////////////////////////////////
-  // logfile.flush write to the SD card
+  // Extra channels of multi-bottle rigs
   /////////////////////////////////
-  Blink(GREEN_LED, 25, 2);
-  logfile.flush();
+  for (uint8_t ch = 2; ch < TB_CHANNELS; ch++) {
+    record.print(channel[ch].pokes);
+    record.print(",");
+    record.print(channel[ch].licks);
+    record.print(",");
+    record.print(channel[ch].delivers);
+    record.print(",");
+  }
+
+  /////////////////////////////////
+  // Sequence number and CRC32 of the record
+  /////////////////////////////////
+  if (record.truncated) logRecordsTruncated++;
+  logSeq++;
+  sealRecord(record, logSeq);
+
+  /////////////////////////////////
+  // Append the record to the SD card with one write
+  /////////////////////////////////
+  bool written = writeRecord(record.buf, record.len);
+
+  //if FED3 cannot write to the file put SD card icon on screen 
+  if constexpr (TBConfig::display) display.fillRect (68, 1, 15, 22, WHITE); //clear a space
+  if (TBConfig::display && ! written ) {
+  
+    //draw SD card icon
+    display.drawRect (70, 2, 11, 14, BLACK);
+    display.drawRect (69, 6, 2, 10, BLACK);
+    display.fillRect (70, 7, 4, 8, WHITE);
+    display.drawRect (72, 4, 1, 3, BLACK);
+    display.drawRect (74, 4, 1, 3, BLACK);
+    display.drawRect (76, 4, 1, 3, BLACK);
+    display.drawRect (78, 4, 1, 3, BLACK);
+    //exclamation point
+    display.fillRect (72, 6, 6, 16, WHITE);
+    display.setCursor(74, 16);
+    display.setTextSize(2);
+    display.setFont(&Org_01);
+    display.print("!");
+    display.setFont(&FreeSans9pt7b);
+    display.setTextSize(1);
+  }
+  if (logBlinkSteps == 0) {
+    logBlinkSteps = 4;
+    logBlinkNext = millis();
+  }
+  heartbeat(SECTION_LOGGING);
+  enterSection(section);
+}
+
+
+
+//Open the session logfile for appending.  Restarting the card blocks for its whole timeout when
+//it is gone, so only the backed-off drain asks for it
+bool FED3::openLogFile(bool restartCard) {
+  //fix filename (the .CSV extension can become corrupted) and open file
+  filename[16] = '.';
+  filename[17] = 'C';
+  filename[18] = 'S';
+  filename[19] = 'V';
+  logfile = SD.open(filename, FILE_WRITE);
+  if (!logfile && restartCard) {
+    SD.begin(SdioConfig(FIFO_SDIO));
+    logfile = SD.open(filename, FILE_WRITE);
+  }
+  return logfile;
+}
+
+//Append one complete record.  Writes are buffered by SdFat and synced by syncLog().
+//While the card is failing, records go to the event store to keep them in order
+bool FED3::writeRecord(const char* data, size_t len) {
+  if (eventStoreRecords > 0) {
+    storeRecord(data, len);
+    return false;
+  }
+  if (!logfile && !openLogFile()) {
+    storeRecord(data, len);
+    return false;
+  }
+  if (logfile.write(data, len) != len) {
+    logfile.close();                       //reopen when the event store is drained
+    storeRecord(data, len);
+    return false;
+  }
+  if (unsyncedLen + len <= UNSYNCED_SIZE) {
+    memcpy(&unsyncedRecords[unsyncedLen], data, len);
+    unsyncedLen += len;
+  }
+  else unsyncedOverflow++;
+  logDirty = true;
+  if (logSyncInterval == 0) syncLog();
+  return true;
+}
+
+//Push buffered records and the directory entry out to the card
+void FED3::syncLog() {
+  logDirty = false;
+  lastLogSync = millis();
+  if (!logfile) return;
+  if (logfile.sync()) {
+    unsyncedLen = 0;
+    unsyncedOverflow = 0;
+    return;
+  }
+  //The card failed under the buffered records: close it and queue them again, in order, for
+  //the drain.  The store is empty here, records only go to the file while it is
   logfile.close();
+  uint32_t requeued = 0;
+  uint32_t start = 0;
+  for (uint32_t i = 0; i < unsyncedLen; i++) {
+    if (unsyncedRecords[i] != '\n') continue;
+    storeRecord(&unsyncedRecords[start], i + 1 - start);
+    start = i + 1;
+    requeued++;
+  }
+  eventStoreLost += unsyncedOverflow;
+  char msg[56];
+  snprintf(msg, sizeof(msg), "SDSyncFailed:requeued=%lu:lost=%lu", (unsigned long)requeued,
+           (unsigned long)unsyncedOverflow);
+  unsyncedLen = 0;
+  unsyncedOverflow = 0;
+  Serial.println(msg);
+  Event = msg;
+  logdata();                               //goes to the store behind them
+}
+
+//Pick the event store: PSRAM if the Teensy 4.1 has a chip fitted, DMAMEM otherwise
+void FED3::eventStoreBegin() {
+#if defined(ARDUINO_TEENSY41)
+  if (external_psram_size > 0) {
+    eventStore = psramEventStore;
+    eventStoreSize = PSRAM_STORE_SIZE;
+  }
+#endif
+  storeHead = storeTail = storeUsed = 0;
+  eventStoreRecords = 0;
+  Serial.print(F("Event store: "));
+  Serial.print(eventStoreSize / 1024);
+  Serial.println(eventStore == dmamemEventStore ? F(" kB DMAMEM") : F(" kB PSRAM"));
+}
+
+//Keep a record that could not be written to the card, or count it as lost if the store is full
+void FED3::storeRecord(const char* data, size_t len) {
+  if (len > eventStoreSize - storeUsed) {
+    eventStoreLost++;
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    eventStore[storeHead] = data[i];
+    if (++storeHead == eventStoreSize) storeHead = 0;
+  }
+  storeUsed += len;
+  eventStoreRecords++;
+  eventStoreBuffered++;
 }
 
+//Try to reopen the card and write the stored records back, a bounded chunk per call.  The
+//chunk leaves the store only once it is synced.  Failed card restarts back off up to SD_RETRY_MAX
+void FED3::drainEventStore() {
+  lastSDRetry = millis();
+  if (!logfile && !openLogFile(true)) {
+    sdRetryDelay = min(sdRetryDelay * 2, SD_RETRY_MAX);
+    return;
+  }
+  sdRetryDelay = sdRetryInterval;
+
+  uint32_t budget = 32UL * 1024;           //bytes per call, keeps run() responsive during a long drain
+  uint32_t tail = storeTail;
+  uint32_t used = storeUsed;
+  uint32_t records = 0;
+  while (used > 0 && budget > 0) {
+    uint32_t chunk = min(used, eventStoreSize - tail);
+    chunk = min(chunk, budget);
+    if (logfile.write(&eventStore[tail], chunk) != chunk) {
+      logfile.close();                     //card failed again, rewrite from storeTail next time
+      return;
+    }
+    for (uint32_t i = 0; i < chunk; i++) {
+      if (eventStore[tail + i] == '\n') records++;
+    }
+    tail += chunk;
+    if (tail == eventStoreSize) tail = 0;
+    used -= chunk;
+    budget -= chunk;
+  }
+  if (!logfile.sync()) {
+    logfile.close();
+    return;
+  }
+  noInterrupts();
+  storeTail = tail;
+  storeUsed = used;
+  interrupts();
+  eventStoreRecords -= records;
+  logDirty = false;
+  lastLogSync = millis();
+
+  if (storeUsed == 0) {
+    eventStoreRecords = 0;
+    char msg[64];
+    snprintf(msg, sizeof(msg), "SDRecovered:buffered=%lu:lost=%lu",
+             (unsigned long)eventStoreBuffered, (unsigned long)eventStoreLost);
+    Serial.println(msg);
+    Event = msg;
+    logdata();
+  }
+}
 
+// Recovery pass for a journaled logfile: finds the last record whose CRC checks out and
+// truncates anything after it (a record torn by a power loss).  Returns the number of valid
+// records, -1 if the file has no journaled header (older library versions), or -2 if it holds
+// records but none of them checks out: that file is left alone.
+int32_t FED3::recoverLogFile(const char *name) {
+  static const bool journalOK = journalSelfTest();
+  if (!journalOK) {
+    Serial.println("Journal self-test failed, logfiles are not repaired");
+    return -2;
+  }
+  FsFile file = SD.open(name, O_RDWR);
+  if (!file) return -1;
+  
+  char line[LOG_RECORD_SIZE];
+  size_t len = 0;
+  bool tooLong = false;
+  bool header = true;
+  int32_t records = 0;
+  int32_t rejected = 0;
+  uint64_t pos = 0;
+  uint64_t lastGood = 0;
+  uint8_t block[512];
+  int n;
+  while ((n = file.read(block, sizeof(block))) > 0) {
+    watchdogService();
+    for (int i = 0; i < n; i++) {
+      char c = block[i];
+      pos++;
+      if (c != '\n') {
+        if (len < sizeof(line)) line[len++] = c;
+        else tooLong = true;
+        continue;
+      }
+      if (header) {
+        header = false;
+        while (len > 0 && line[len - 1] == '\r') len--;
+        if (len < 4 || strncmp(&line[len - 4], ",CRC", 4) != 0) {
+          file.close();
+          return -1;
+        }
+        lastGood = pos;
+      }
+      else if (!tooLong && recordValid(line, len)) {
+        records++;
+        lastGood = pos;
+      }
+      else rejected++;
+      len = 0;
+      tooLong = false;
+    }
+  }
+  
+  if (header) {                            //not even a complete header line
+    file.close();
+    return -1;
+  }
+  if (records == 0 && rejected > 1) {      //more than a torn first record: not ours to cut
+    file.close();
+    return -2;
+  }
+  if (file.fileSize() > lastGood) {
+    Serial.print("Recovered ");
+    Serial.print(name);
+    Serial.print(": truncating torn tail at byte ");
+    Serial.println((unsigned long)lastGood);
+    file.truncate(lastGood);
+    file.sync();
+  }
+  file.close();
+  return records;
+}
 
 // If any errors are detected with the SD card upon boot this function
 // will blink both LEDs on the Feather M0, turn the NeoPixel into red wipe pattern,
 // and display "Check SD Card" on the screen
 void FED3::error(uint8_t errno) {
   if (suppressSDerrors == false){
+    enterSection(SECTION_ERROR);  //stop feeding the watchdog, it will reset the Teensy and retry
     DisplaySDError();
     while (1) {
       uint8_t i;
@@ -1315,7 +3861,22 @@ void FED3::getFilename(char *filename) {
     filename[15] = '0' + i % 10;
 
     if (SD.exists(filename)) {
-      // Open the file to check its length
+      // Journaled logfiles are repaired, and reused if they hold no records
+      int32_t records = recoverLogFile(filename);
+      if (records == 0) {
+        SD.remove(filename);
+        break;
+      }
+      if (records > 0) continue;
+      if (records == -2) {                 //unreadable records: keep them as .BAD, reuse the name
+        char aside[22];
+        strcpy(aside, filename);
+        strcpy(aside + 17, "BAD");
+        if (!SD.exists(aside) && SD.rename(filename, aside)) break;
+        continue;
+      }
+
+      // Older logfiles: open the file to check its length
       FsFile file = SD.open(filename, FILE_READ);
       if (file) {
         int lineCount = 0;
@@ -1351,6 +3912,8 @@ void FED3::SetDeviceNumber() {
   // This code is activated when both pokes are pressed simultaneously from the 
   //start screen, allowing the user to set the device # of the FED on the device
   while (SetFED == true) {
+    enterSection(SECTION_MENU);
+    watchdogService();
     //adjust FED device number
     display.fillRect (0, 0, 200, 80, WHITE);
     display.setCursor(5, 46);
@@ -1401,6 +3964,7 @@ void FED3::SetDeviceNumber() {
       ///////////////////////////////////
       //////////  ADJUST CLOCK //////////
       while (millis() - EndTime < 3000) { 
+        watchdogService();
         SetClock();
         delay (10);
       }
@@ -1413,6 +3977,7 @@ void FED3::SetDeviceNumber() {
       ///////////////////////////////////
       
       while (setTimed == true) {
+        watchdogService();
         // set timed feeding start and stop
         display.fillRect (5, 56, 120, 18, WHITE);
         delay (200);
@@ -1506,17 +4071,18 @@ void FED3::SetClock(){
   display.refresh();
 
   if (digitalRead(LEFT_POKE) == LOW) {
-    tone (BUZZER, 800, 1);
+    Tone(800, 1);
     setTime(now() - 60);
     EndTime = millis();
   }
 
   if (digitalRead(RIGHT_POKE) == LOW) {
-    tone (BUZZER, 800, 1);
+    Tone(800, 1);
     setTime(now() + 60);
     EndTime = millis();
   }
   Teensy3Clock.set(now());
+  syncWallClock();
 }
 
 //Read battery level
@@ -1525,6 +4091,15 @@ void FED3::ReadBatteryLevel() {
   measuredvbat = analogRead(VBATPIN) * 3.3 / 4096.0 * 2.0;
 }
 
+//Sample the AHT20.  A conversion takes ~80 ms, so it runs as a task rather than per log line
+void FED3::readEnvironment() {
+  if (!TBConfig::aht20 || !tempSensor) return;
+  sensors_event_t hum, temp;
+  aht.getEvent(&hum, &temp);
+  temperature = temp.temperature;
+  humidity = hum.relative_humidity;
+}
+
 /**************************************************************************************************************************************************
                                                                                                Interrupts and sleep
 **************************************************************************************************************************************************/
@@ -1536,57 +4111,353 @@ void FED3::enableSleep(){
   EnableSleep = true;                             
 }
 
-//What happens when left poke is poked
+//What happens when left poke is poked or cleared: note the edge and let the debounce timer confirm it
 void FED3::leftTrigger() {
-  if (!leftHeld && digitalRead(LEFT_POKE) == LOW ) {
-      Left = true;
-      leftHeld = true;
-  }
+  pokeEdge(0);
 }
 
-//What happens when right poke is poked
+//What happens when right poke is poked or cleared
 void FED3::rightTrigger() {
-  if (!rightHeld && digitalRead(RIGHT_POKE) == LOW ) {
-    Right = true;
-    rightHeld = true;
+  pokeEdge(1);
+}
+
+void FED3::pokeEdge(uint8_t side) {
+  uint64_t t = clockMicros();
+  if (!pokeEdgePending[side]) {
+    pokeEdgeTime[side] = t;
+    pokeEdgePending[side] = true;
+  }
+  pokeLastEdgeMicros[side] = (uint32_t)t;
+  if (!pokeTimerRunning) {
+    pokeTimerRunning = true;
+    pokeTimer.begin(outsidePokeDebounceHandler, pokeDebounceMicros);
+  }
+}
+
+//Glitch filter: a transition only counts once the pin has been quiet for pokeDebounceMicros
+//and reads a new level.  Confirmed transitions are queued with the time of their first edge
+void FED3::pokeDebounce() {
+  bool pending = false;
+  for (uint8_t side = 0; side < TB_CHANNELS; side++) {
+    if (!pokeEdgePending[side]) continue;
+    if ((uint32_t)clockMicros() - pokeLastEdgeMicros[side] < pokeDebounceMicros) {
+      pending = true;
+      continue;
+    }
+    pokeEdgePending[side] = false;
+    bool broken = (digitalReadFast(channel[side].pins.poke) == LOW);
+    if (broken == pokeBroken[side]) continue;          //a glitch, the level did not change
+    pokeBroken[side] = broken;
+    uint8_t next = (pokeQueueHead + 1) % POKE_QUEUE_SIZE;
+    if (next == pokeQueueTail) continue;               //queue full, run() is far behind
+    pokeQueue[pokeQueueHead].side = side;
+    pokeQueue[pokeQueueHead].entry = broken;
+    pokeQueue[pokeQueueHead].time = pokeEdgeTime[side];
+    pokeQueueHead = next;
+  }
+  if (!pending) {
+    pokeTimer.end();
+    pokeTimerRunning = false;
   }
 }
 
 //Sleep function
 void FED3::goToSleep() {
   if (EnableSleep==true){
-    ReleaseMotor();
-    delay (5000); //let things settle  //Wake up every 5 sec to check the pellet well
+    ReleaseMotor();  //power down the drivers between dispenses; run() no longer waits here
   }    
 }
 
 //Pull all motor pins low to de-energize stepper and save power, also disable motor driver with the EN pin
+//A motor that is still turning is left alone
 void FED3::ReleaseMotor () {
-  digitalWrite(L_IN1, LOW);
-  digitalWrite(L_IN2, LOW);
-  digitalWrite(L_IN3, LOW);
-  digitalWrite(L_IN4, LOW);
-  digitalWrite(R_IN1, LOW);
-  digitalWrite(R_IN2, LOW);
-  digitalWrite(R_IN3, LOW);
-  digitalWrite(R_IN4, LOW);
-  if (EnableSleep==true){
-    digitalWrite(MOTOR_ENABLE_LEFT, LOW);  //disable motor driver and neopixels
-    digitalWrite(MOTOR_ENABLE_RIGHT, LOW);
+  uint8_t busyDrivers = 0;   //channels can share a driver; keep it on while any of them turns
+  for (uint8_t side = 0; side < TB_CHANNELS; side++) {
+    if (motorBusy(side)) busyDrivers |= channel[side].pins.driver;
+  }
+  for (uint8_t side = 0; side < TB_CHANNELS; side++) {
+    if (motorBusy(side)) continue;
+    for (uint8_t i = 0; i < 4; i++) digitalWrite(channel[side].pins.motor[i], LOW);
+    if (EnableSleep==true){
+      releaseDriverPower(channel[side].pins.driver & ~busyDrivers, POWER_MOTOR);  //disable motor driver
+    }
+  }
+}
+
+/**************************************************************************************************************************************************
+                                                                                               Timebase
+**************************************************************************************************************************************************/
+//Monotonic µs since boot.  Safe to call from interrupts
+uint64_t FED3::clockMicros() {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  uint32_t cycles = ARM_DWT_CYCCNT;
+  uint32_t ms = millis();
+  uint32_t cyclesPerMs = F_CPU_ACTUAL / 1000;
+  uint32_t delta = cycles - clockLastCycles;
+  uint64_t expected = (uint64_t)(ms - clockLastMillis) * cyclesPerMs;
+  uint64_t elapsed = delta;
+  if (expected + 0x80000000ULL > delta) {
+    elapsed += ((expected + 0x80000000ULL - delta) >> 32) << 32;  //add the wraps millis() says were missed
+  }
+  clockLastCycles = cycles;
+  clockLastMillis = ms;
+  clockCycles += elapsed;
+  uint64_t us = clockCycles / (cyclesPerMs / 1000);
+  if (!primask) __enable_irq();
+  return us;
+}
+
+//RTC time in µs since 1970, including the 32.768 kHz sub-second count
+static uint64_t rtcMicros() {
+  uint32_t hi, lo;
+  do {
+    hi = SNVS_HPRTCMR;
+    lo = SNVS_HPRTCLR;
+  } while (hi != SNVS_HPRTCMR || lo != SNVS_HPRTCLR);
+  uint32_t seconds = (hi << 17) | (lo >> 15);
+  return (uint64_t)seconds * 1000000 + (((lo & 0x7FFF) * 1000000ULL) >> 15);
+}
+
+//Wall offset at clock time "t", part way through the current slew.  Times before the slew
+//started get its starting offset.  Safe to call from interrupts
+static int64_t wallOffsetAt(uint64_t t) {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __disable_irq();
+  int64_t offset = wallOffsetMicros;
+  if (t > slewStart && slewPpm != 0) {
+    int64_t applied = (int64_t)(t - slewStart) * slewPpm / 1000000;
+    if (slewRemaining >= 0 ? applied > slewRemaining : applied < slewRemaining) applied = slewRemaining;
+    offset += applied;
+  }
+  if (!primask) __enable_irq();
+  return offset;
+}
+
+//Wall time in µs since 1970
+uint64_t FED3::wallMicros() {
+  uint64_t t = clockMicros();
+  return t + wallOffsetAt(t);
+}
+
+//Step the wall clock to the RTC, e.g. after the RTC has been set
+void FED3::syncWallClock() {
+  uint64_t t = clockMicros();
+  noInterrupts();
+  wallOffsetMicros = (int64_t)rtcMicros() - (int64_t)t;
+  slewStart = t;
+  slewPpm = 0;
+  slewRemaining = 0;
+  interrupts();
+  clockError = 0;
+  lastClockDiscipline = millis();
+}
+
+//Keep wall time in step with the RTC.  The crystal-driven RTC is the long-term reference and
+//the cycle counter the short-term one, so small errors are slewed out over the next period at
+//no more than CLOCK_SLEW_PPM; only large errors (RTC set, clock lost) step the wall clock, and
+//each step is logged as a ClockStep event
+void FED3::serviceClock() {
+  if (millis() - lastClockDiscipline < clockDisciplineInterval) return;
+  lastClockDiscipline = millis();
+  uint64_t t = clockMicros();
+  int64_t offset = wallOffsetAt(t);
+  int64_t error = (int64_t)rtcMicros() - (int64_t)(t + offset);
+  clockError = (error > INT32_MAX) ? INT32_MAX : (error < -INT32_MAX) ? -INT32_MAX : error;
+  bool step = (error > CLOCK_STEP_MICROS || error < -CLOCK_STEP_MICROS);
+  int64_t ppm = 0;
+  if (!step && error != 0) {
+    ppm = error * 1000000 / ((int64_t)clockDisciplineInterval * 1000);
+    if (ppm > CLOCK_SLEW_PPM) ppm = CLOCK_SLEW_PPM;
+    if (ppm < -CLOCK_SLEW_PPM) ppm = -CLOCK_SLEW_PPM;
+    if (ppm == 0) ppm = (error > 0) ? 1 : -1;
+  }
+  noInterrupts();
+  wallOffsetMicros = step ? offset + error : offset;
+  slewStart = t;
+  slewPpm = ppm;
+  slewRemaining = step ? 0 : error;
+  interrupts();
+  writeLickOffset();
+  if (step) {
+    char msg[40];
+    snprintf(msg, sizeof(msg), "ClockStep:%lldus", (long long)error);
+    Serial.println(msg);
+    Event = msg;
+    logdata();
+  }
+}
+
+/**************************************************************************************************************************************************
+                                                                                               Watchdog and diagnostics
+**************************************************************************************************************************************************/
+// Start the i.MX RT WDOG1.  It must be fed at least every "seconds" or the Teensy resets;
+// run() and the startup menus feed it only while every watched subsystem reports in, so a hang
+// anywhere else, or a subsystem that stops making progress, ends in a reset
+void FED3::watchdogBegin(uint8_t seconds) {
+  if (seconds < 1) seconds = 1;
+  if (seconds > 128) seconds = 128;
+  watchdogTimeout = seconds;
+  CCM_CCGR3 |= CCM_CCGR3_WDOG1(3);       //make sure the WDOG1 clock is running
+  WDOG1_WMCR = 0;                        //disable the power-down counter
+  attachInterruptVector(IRQ_WDOG1, watchdogWarningISR);
+  NVIC_SET_PRIORITY(IRQ_WDOG1, 0);
+  NVIC_ENABLE_IRQ(IRQ_WDOG1);
+  WDOG1_WICR = (1 << 15) | 1;            //WIE, warning interrupt 0.5 s before the time-out
+  // WT time-out in 0.5 s steps | WDA | SRS | WDE | WDBG | WDZST
+  WDOG1_WCR = ((seconds * 2 - 1) << 8) | (1 << 5) | (1 << 4) | (1 << 2) | (1 << 1) | (1 << 0);
+  watchdogFeed();
+}
+
+//Service sequence to reload the watchdog counter
+void FED3::watchdogFeed() {
+  WDOG1_WSR = 0x5555;
+  WDOG1_WSR = 0xAAAA;
+}
+
+//Feed the watchdog if every watched subsystem has reported in.  Called from run(), and from the
+//startup menus and log recovery, which run before the first run()
+void FED3::watchdogService() {
+  if (heartbeatsFresh()) watchdogFeed();
+}
+
+//Expect a heartbeat from subsystem at least every maxAgeMs, 0 stops watching it
+void FED3::watchHeartbeat(uint8_t subsystem, uint32_t maxAgeMs) {
+  if (subsystem >= NUM_SECTIONS) return;
+  heartbeat(subsystem);
+  heartbeatMaxAge[subsystem] = maxAgeMs;
+}
+
+bool FED3::heartbeatsFresh() {
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < NUM_SECTIONS; i++) {
+    if (heartbeatMaxAge[i] != 0 && now - resetDiag.heartbeatMillis[i] > heartbeatMaxAge[i]) return false;
   }
+  return true;
+}
+
+//Record the hot-path section we are entering, returns the previous one so callers can restore it
+uint8_t FED3::enterSection(uint8_t section) {
+  uint8_t previous = resetDiag.section;
+  resetDiag.section = section;
+  resetDiag.sectionMillis = millis();
+  return previous;
+}
+
+//Called by each subsystem when it completes a unit of work
+void FED3::heartbeat(uint8_t subsystem) {
+  resetDiag.heartbeatMillis[subsystem] = millis();
+  resetDiag.heartbeatCount[subsystem]++;
+}
+
+//After a watchdog reset, write where the last run was stuck and its loop-latency stats to the log
+void FED3::logResetDiagnostics() {
+  if (!watchdogReset || previousDiag.magic != RESET_DIAG_MAGIC) return;
+  uint32_t gasp = previousDiag.lastGaspMillis ? previousDiag.lastGaspMillis : previousDiag.sectionMillis;
+  uint8_t section = previousDiag.section < NUM_SECTIONS ? previousDiag.section : SECTION_LOOP;
+  char msg[160];
+  snprintf(msg, sizeof(msg), "WatchdogReset:%s:stuck=%lums:loopMax=%luus:loopMean=%luus:licksAge=%lums:logAge=%lums:motorAge=%lums",
+           sectionNames[section],
+           (unsigned long)(gasp - previousDiag.sectionMillis),
+           (unsigned long)previousDiag.loopMaxMicros,
+           (unsigned long)previousDiag.loopMeanMicros,
+           (unsigned long)(gasp - previousDiag.heartbeatMillis[SECTION_LICKS]),
+           (unsigned long)(gasp - previousDiag.heartbeatMillis[SECTION_LOGGING]),
+           (unsigned long)(gasp - previousDiag.heartbeatMillis[SECTION_MOTOR]));
+  Serial.println(msg);
+  Event = msg;
+  logdata();
+}
+
+/**************************************************************************************************************************************************
+                                                                                               Memory map
+**************************************************************************************************************************************************/
+// FED3 is declared as a global in the sketch, so it lives in DTCM next to the stack
+static_assert(sizeof(FED3) < 16 * 1024, "FED3 has outgrown its DTCM budget, move large buffers to TB_RAM2 or TB_EXTMEM");
+
+static const char* memoryRegion(const void *p) {
+  uint32_t a = (uint32_t)p;
+  if (a < 0x00080000) return "ITCM";
+  if (a >= 0x20000000 && a < 0x20080000) return "RAM1/DTCM";
+  if (a >= 0x20200000 && a < 0x20280000) return "RAM2/OCRAM";
+  if (a >= 0x70000000 && a < 0x71000000) return "EXTMEM";
+  return "other";
+}
+
+static void printMemoryItem(Print &out, const char *name, const void *p, uint32_t bytes) {
+  out.print(name);
+  out.print(",");
+  out.print(memoryRegion(p));
+  out.print(",0x");
+  out.print((uint32_t)p, HEX);
+  out.print(",");
+  out.println(bytes);
+}
+
+//Report where the library's state and buffers live, and how full each RAM region is.  Arduino
+//libraries get no post-link step, so the footprint is read from the linker symbols at run time;
+//begin() prints it to Serial once per boot
+void FED3::printMemoryMap(Print &out) {
+  uint32_t code = (uint32_t)&_etext - (uint32_t)&_stext;
+  uint32_t ram1 = (uint32_t)&_ebss - (uint32_t)&_sdata;
+  uint32_t ram2Static = (uint32_t)&_heap_start - 0x20200000;
+  uint32_t ram2Heap = (uint32_t)__brkval - (uint32_t)&_heap_start;
+  out.println(F("Region,Bytes used,Bytes total"));
+  out.print(F("RAM1 code (ITCM),")); out.print(code); out.println(",");
+  out.print(F("RAM1 data+bss (DTCM),")); out.print(ram1); out.println(",");
+  out.print(F("RAM1 stack (DTCM),")); out.print((uint32_t)&_estack - (uint32_t)__builtin_frame_address(0));
+  out.print(","); out.println((uint32_t)&_estack - (uint32_t)&_ebss);  //depth at this call, room above bss
+  out.print(F("RAM2 DMAMEM,")); out.print(ram2Static); out.println(",");
+  out.print(F("RAM2 heap,")); out.print(ram2Heap); out.print(",");
+  out.println((uint32_t)&_heap_end - (uint32_t)&_heap_start);
+#if defined(ARDUINO_TEENSY41)
+  out.print(F("EXTMEM,")); out.print((uint32_t)&_extram_end - (uint32_t)&_extram_start); out.print(",");
+  out.println((uint32_t)external_psram_size * 1024 * 1024);
+#endif
+  out.println(F("Object,Region,Address,Bytes"));
+  printMemoryItem(out, "FED3", this, sizeof(FED3));
+  printMemoryItem(out, "log record", &record, sizeof(record));
+  printMemoryItem(out, "reset diagnostics", &resetDiag, sizeof(resetDiag));
+  printMemoryItem(out, "event store", eventStore, eventStoreSize);
+  printMemoryItem(out, "raw capture queue", rawQueue, sizeof(rawQueue));
+  printMemoryItem(out, "NeoPixel buffer", strip.getPixels(), strip.numPixels() * 4);
 }
 
 /**************************************************************************************************************************************************
                                                                                                Startup Functions
 **************************************************************************************************************************************************/
 //Constructor
-FED3::FED3(void) {};
+FED3::FED3(void) {
+  initChannels();
+}
 
 //Import Sketch variable from the Arduino script
 FED3::FED3(String sketch) {
+  initChannels();
   sessiontype = sketch;
 }
 
+//Name the channels and wire channels 0 and 1 to the stock left/right hardware
+void FED3::initChannels() {
+  static const ChannelPins stock[2] = {
+    {LEFT_POKE, LEFT_LICK, {L_IN1, L_IN2, L_IN3, L_IN4}, DRIVER_LEFT},
+    {RIGHT_POKE, RIGHT_LICK, {R_IN1, R_IN2, R_IN3, R_IN4}, DRIVER_RIGHT}};
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    Channel &c = channel[ch];
+    if (ch < 2) c.pins = stock[ch];
+    if (ch == SIDE_LEFT) strcpy(c.name, "Left");
+    else if (ch == SIDE_RIGHT) strcpy(c.name, "Right");
+    else snprintf(c.name, sizeof(c.name), "Ch%u", ch + 1);
+  }
+}
+
+//Pins of an extra channel (or a rewired stock one).  Call before begin()
+void FED3::setChannelPins(uint8_t ch, const ChannelPins &pins) {
+  if (ch < TB_CHANNELS) channel[ch].pins = pins;
+}
+
 //  dateTime function
 void dateTime(uint16_t* date, uint16_t* time) {
   time_t nowTime = now();
@@ -1598,67 +4469,85 @@ void dateTime(uint16_t* date, uint16_t* time) {
 }
 
 void FED3::begin() {
+  pointerToFED3 = this;                 //before any interrupt below can reach the handlers
   Serial.begin(9600);
+
+  // Keep the diagnostics of the previous run, then start a fresh record and arm the watchdog
+  watchdogReset = (WDOG1_WRSR & (1 << 1));   //TOUT, last reset was a WDOG1 time-out
+  previousDiag = resetDiag;
+  memset(&resetDiag, 0, sizeof(resetDiag));
+  resetDiag.magic = RESET_DIAG_MAGIC;
+  watchdogBegin(watchdogTimeout);
+
   Serial.println(F("→ begin(): pin init"));
   setSyncProvider(Teensy3Clock.get);   // pull time from hardware RTC
   if (timeStatus() != timeSet) {
     setTime(2025, 1, 1, 0, 0, 0);    // emergency fallback – keeps FAT filenames legal
+    Teensy3Clock.set(now());
   }
+  syncWallClock();
   // Initialize pins
 
-  pinMode(LEFT_POKE, INPUT_PULLUP);
-  pinMode(RIGHT_POKE, INPUT_PULLUP);
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    pinMode(channel[ch].pins.poke, INPUT_PULLUP);
+    for (uint8_t i = 0; i < 4; i++) pinMode(channel[ch].pins.motor[i], OUTPUT);
+  }
   pinMode(VBATPIN, INPUT);
   pinMode(MOTOR_ENABLE_LEFT, OUTPUT);
   pinMode(MOTOR_ENABLE_RIGHT, OUTPUT);
   pinMode(GREEN_LED, OUTPUT);
   pinMode(BUZZER, OUTPUT);
-  pinMode(L_IN1, OUTPUT);
-  pinMode(L_IN2, OUTPUT);
-  pinMode(L_IN3, OUTPUT);
-  pinMode(L_IN4, OUTPUT);
-  pinMode(R_IN1, OUTPUT);
-  pinMode(R_IN2, OUTPUT);
-  pinMode(R_IN3, OUTPUT);
-  pinMode(R_IN4, OUTPUT);
   pinMode(BNC_OUT, OUTPUT);
   pinMode(MPR121_IRQ, INPUT_PULLUP);
   mprWire->setSDA(MPR121_SDA);      // pins 25 / 24
   mprWire->setSCL(MPR121_SCL);
   mprWire->begin();                 // start Wire2
+  mprWire->setClock(400000);        // fast mode, the MPR121's maximum
 
   //initilize the MPR121
 // initialise touch sensor on Wire2 with thresholds and autoconfig
-  if (!cap.begin(0x5A, mprWire, 9, 4, true)) {   //  ← add the last three arguments
+  if (!cap.begin(MPR121_ADDR, mprWire, 9, 4, true)) {   //  ← add the last three arguments
     Serial.println("MPR121 not found. Check wiring.");
     error(6);
   }
 
   cap.setThresholds(9, 4); // Set touch and release thresholds
+  memset(touchThreshold, 9, sizeof(touchThreshold));
+  memset(releaseThreshold, 4, sizeof(releaseThreshold));
+  attachInterruptVector(IRQ_LPI2C4, outsideMprI2CHandler);  // async reads on Wire2
+  NVIC_SET_PRIORITY(IRQ_LPI2C4, 96);
+  NVIC_ENABLE_IRQ(IRQ_LPI2C4);
   attachInterrupt(digitalPinToInterrupt(MPR121_IRQ), outsideLickIRQ, FALLING); // Attach interrupt for MPR121
 
   // Initialize RTC
   //rtc.begin();'
 
   // Initialize Neopixels
-  strip.begin();
-  strip.show(); // Initialize all pixels to 'off'
+  if constexpr (TBConfig::neopixels) {
+    strip.begin();
+    strip.show(); // Initialize all pixels to 'off'
+  }
 
   // Initialize stepper
   digitalWrite(MOTOR_ENABLE_LEFT, LOW);  // Disable left motor driver
   digitalWrite(MOTOR_ENABLE_RIGHT, LOW); // Disable right motor driver
 
   // Initialize display
-  display.begin();
-  //const int minorHalfSize = min(display.width(), display.height()) / 2;
-  display.setFont(&FreeSans9pt7b);
-  display.setRotation(3);
-  display.setTextColor(BLACK);
-  display.setTextSize(1);
+  if constexpr (TBConfig::display) {
+    display.begin();
+    //const int minorHalfSize = min(display.width(), display.height()) / 2;
+    display.setFont(&FreeSans9pt7b);
+    display.setRotation(3);
+    display.setTextColor(BLACK);
+    display.setTextSize(1);
+  }
  
   //Is AHT20 temp humidity sensor present?
-  if (aht.begin()) {
-    tempSensor = true;
+  if constexpr (TBConfig::aht20) {
+    if (aht.begin()) {
+      tempSensor = true;
+      readEnvironment();
+    }
   }
  
   // Initialize SD card and create the datafile
@@ -1666,32 +4555,54 @@ void FED3::begin() {
   SdFile::dateTimeCallback(dateTime);
   #endif
   Serial.println(F("→ begin(): CreateFile()"));
+  eventStoreBegin();
   CreateFile();
   Serial.println(F("returned from CreateFile"));
+  seedRandom(rngSeed != 0 ? rngSeed : freshSeed());
+  if (psygene && (FEDmode == 0 || FEDmode == 2)) {
+    sessiontype = (FEDmode == 0) ? "Bandit100" : "Bandit80";
+    startBandit(FEDmode == 0 ? 100 : 80, FEDmode == 0 ? 0 : 20);
+  }
+  loadSchedule();
   CreateDataFile();
   Serial.println(F("returned from CreateDataFile"));
   writeHeader();
   Serial.println(F("returned from writeHeader"));
+  logResetDiagnostics();
+  {
+    char msg[32];
+    snprintf(msg, sizeof(msg), "RandomSeed:%08lX%08lX", (unsigned long)(rngSeed >> 32), (unsigned long)rngSeed);
+    Event = msg;
+    logdata();
+  }
+  if (scheduleLoaded) {
+    Event = String("Schedule:") + scheduleRule;
+    logdata();
+  }
+  printMemoryMap(Serial);
   // Initialize interrupts
-  pointerToFED3 = this;
-  attachInterrupt(digitalPinToInterrupt(LEFT_POKE), outsideLeftTriggerHandler, FALLING);
-  attachInterrupt(digitalPinToInterrupt(RIGHT_POKE), outsideRightTriggerHandler, FALLING);
+  for (uint8_t ch = 0; ch < TB_CHANNELS; ch++) {
+    pokeBroken[ch] = (digitalRead(channel[ch].pins.poke) == LOW);
+  }
+  attachPokeHandlers<0>(this);
   // Create data file for current session
   
   EndTime = 0;
   
   //read battery level
   ReadBatteryLevel();
+  startTasks();
   
   // Startup display uses StartScreen() unless ClassicFED3==true, then use ClassicMenu()
-  if (ClassicFED3 == true){
+  if constexpr (!TBConfig::display) return;
+  if (TBConfig::menu && ClassicFED3 == true){
     ClassicMenu();
   }
-  else if (FED3Menu == true){
+  else if (TBConfig::menu && FED3Menu == true){
     FED3MenuScreen();
   }
 
-  else if (psygene) {
+  else if (TBConfig::menu && psygene) {
     psygeneMenu();
   }
 
@@ -1736,7 +4647,7 @@ void FED3::SelectMode() {
   // Mode select on startup screen
   //If both pokes are activated
   if ((digitalRead(LEFT_POKE) == LOW) && (digitalRead(RIGHT_POKE) == LOW)) {
-    tone (BUZZER, 3000, 500);
+    Tone(3000, 500);
     colorWipe(strip.Color(2, 2, 2), 40); // Color wipe
     colorWipe(strip.Color(0, 0, 0), 20); // OFF
     EndTime = millis();
@@ -1749,7 +4660,7 @@ void FED3::SelectMode() {
   else if (digitalRead(LEFT_POKE) == LOW) {
     EndTime = millis();
     FEDmode -= 1;
-    tone (BUZZER, 2500, 200);
+    Tone(2500, 200);
     colorWipe(strip.Color(2, 0, 2), 40); // Color wipe
     colorWipe(strip.Color(0, 0, 0), 20); // OFF
     
@@ -1766,7 +4677,7 @@ void FED3::SelectMode() {
   else if (digitalRead(RIGHT_POKE) == LOW) {
     EndTime = millis();
     FEDmode += 1;
-    tone (BUZZER, 2500, 200);
+    Tone(2500, 200);
     colorWipe(strip.Color(2, 2, 0), 40); // Color wipe
     colorWipe(strip.Color(0, 0, 0), 20); // OFF
 
@@ -1836,6 +4747,7 @@ void FED3::SelectMode() {
   }
   
   while (millis() - EndTime < 1500) {
+    watchdogService();
     SelectMode();
   }
   display.setCursor(10, 100);
@@ -1871,16 +4783,16 @@ void FED3::ClassicMenu () {
   if (FEDmode == 1) FR = 1;  // FR1 spatial tracking task
   if (FEDmode == 2) FR = 3;  // FR3
   if (FEDmode == 3) FR = 5; // FR5
-  if (FEDmode == 4) FR = 99;  // Progressive Ratio
+  if (FEDmode == 4) startPR(SIDE_LEFT, PR_SERIES_RR);  // Progressive Ratio
   if (FEDmode == 5) { // Extinction
     FR = 1;
     ReleaseMotor ();
-    digitalWrite (MOTOR_ENABLE, LOW);  //disable motor driver and neopixels
+    releaseDriverPower(DRIVER_LEFT, POWER_MOTOR);  //disable motor driver
     delay(2); //let things settle
   }
   if (FEDmode == 6) FR = 1;  // Light tracking
   if (FEDmode == 7) FR = 1; // FR1 (reversed)
-  if (FEDmode == 8) FR = 1; // PR (reversed)
+  if (FEDmode == 8) startPR(SIDE_RIGHT, PR_SERIES_RR); // PR (reversed)
   if (FEDmode == 9) FR = 1; // self-stim
   if (FEDmode == 10) FR = 1; // self-stim (reversed)
 
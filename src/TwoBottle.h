@@ -56,39 +56,128 @@ typedef void (*voidFuncPtr)(void);
 // Lightweight Teensy replacement for ArduinoLowPower
 
 
-// Pin definitions
-#define NEOPIXEL        18
-#define MOTOR_ENABLE_LEFT    15
-#define MOTOR_ENABLE MOTOR_ENABLE_LEFT // alias for functions still calling motor_enable
-#define MOTOR_ENABLE_RIGHT   35
-#define GREEN_LED       30
-#define LEFT_POKE       22
-#define RIGHT_POKE      21
-#define BUZZER          3
-#define VBATPIN         A6
-#define BNC_OUT         23
-#define SHARP_SCK       12
-#define SHARP_MOSI      11
-#define SHARP_SS        10
-#define MPR121_SDA     25
-#define MPR121_SCL     24
-#define MPR121_IRQ     9
-#define LEFT_LICK 0
-#define RIGHT_LICK 1
-
-#define L_IN1 16
-#define L_IN2 17
-#define L_IN3 14
-#define L_IN4 13
-#define R_IN1 36
-#define R_IN2 37    
-#define R_IN3 34
-#define R_IN4 33
+// Pin map, channel count and optional peripherals
+#include "TwoBottleConfig.h"
+
+#define BNC_MODE_OUTPUT 0
+#define BNC_MODE_INPUT  1
+#define SYNC_OFF     0
+#define SYNC_PULSE   1
+#define SYNC_BARCODE 2
 
 #define MPR_IRQ
 
 #define BLACK 0
 #define WHITE 1
+
+// Memory placement on the Teensy 4.x
+//   RAM1 (DTCM)   default for variables, zero wait states: FED3 itself, hot state and event queues
+//   RAM2 (DMAMEM) cached OCRAM, not cleared at startup: large buffers and anything a DMA engine touches
+//   EXTMEM        optional PSRAM on the Teensy 4.1: bulk storage only
+// RAM2 buffers are cache-line aligned so arm_dcache_flush()/arm_dcache_delete() never touch a neighbour
+#define TB_RAM2 DMAMEM __attribute__((aligned(32)))
+#if defined(ARDUINO_TEENSY41)
+#define TB_EXTMEM EXTMEM __attribute__((aligned(32)))
+#endif
+
+// Hot-path sections and subsystem heartbeats recorded for watchdog diagnostics
+#define SECTION_LOOP     0
+#define SECTION_LICKS    1
+#define SECTION_LOGGING  2
+#define SECTION_MOTOR    3
+#define SECTION_DISPLAY  4
+#define SECTION_MENU     5
+#define SECTION_ERROR    6
+#define NUM_SECTIONS     7
+
+// The motor driver enable pins also power the NeoPixels; each has a set of users
+#define DRIVER_LEFT      0x01
+#define DRIVER_RIGHT     0x02
+#define DRIVER_BOTH      0x03
+#define POWER_LEDS       0x01
+#define POWER_MOTOR      0x02
+#define DRIVER_SETTLE_MICROS 2000   //wait after switching a driver on before pushing pixels
+
+// Sides for dispensing and the awaitable trial API.  A side is a channel number (below)
+#define SIDE_LEFT        0
+#define SIDE_RIGHT       1
+#define SIDE_ANY         0xFF
+
+// Spout channels.  Each channel binds a nose poke, an MPR121 electrode and a stepper; channel 0
+// is the left bottle and channel 1 the right.  Rigs with more bottles set TB_CHANNELS in
+// TwoBottleConfig.h and give the extra channels their pins with setChannelPins() before begin()
+struct ChannelPins {
+  uint8_t poke;                  //nose poke input, LOW while the beam is broken
+  uint8_t electrode;             //MPR121 electrode wired to the spout
+  uint8_t motor[4];              //stepper IN1..IN4
+  uint8_t driver;                //DRIVER_LEFT/DRIVER_RIGHT enable line powering the stepper
+};
+
+// Sequential trial logic without blocking.  A behaviour is a void function that returns at
+// every TB_AWAIT and resumes there the next time it is called, e.g. once per loop():
+//
+//   FED3::Behaviour trial;
+//   void runTrial() {
+//     TB_BEGIN(trial);
+//     fed3.ConditionedStimulus();
+//     TB_AWAIT(trial, fed3.waitPoke(trial, SIDE_LEFT, 5000));
+//     if (trial.result) TB_AWAIT(trial, fed3.dispense(trial, SIDE_LEFT));
+//     TB_AWAIT(trial, fed3.wait(trial, 2000));
+//     TB_END(trial);
+//   }
+//
+// Local variables do not survive an await, keep trial state in statics or globals, and do not
+// put TB_AWAIT inside a switch statement.
+#define TB_BEGIN(b)    switch ((b).line) { case 0:
+#define TB_AWAIT(b, x) do { (b).line = __LINE__; case __LINE__: if (!(x)) return; (b).armed = false; } while (0)
+#define TB_RESTART(b)  do { (b).line = 0; (b).armed = false; return; } while (0)
+#define TB_END(b)      } (b).line = 0
+
+// Reinforcement rules of a schedule file
+#define SCHED_NONE       0
+#define SCHED_FR         1   //fixed ratio
+#define SCHED_VR         2   //variable ratio
+#define SCHED_PR         3   //progressive ratio
+#define SCHED_FI         4   //fixed interval
+#define SCHED_VI         5   //variable interval
+#define SCHED_LICK       6   //every n licks
+#define SCHED_BANDIT     7   //probabilistic reward per side
+#define SCHED_EXT        8   //extinction
+
+// Progressive-ratio series
+#define PR_SERIES_LINEAR   0   //1, 1+step, 1+2*step, ...
+#define PR_SERIES_RR       1   //Richardson-Roberts: round(5*e^(0.2*j) - 5) = 1, 2, 4, 6, 9, 12, 15, 20, ...
+#define PR_SERIES_DOUBLING 2   //1, 2, 4, 8, ...
+
+// What advances a bandit block
+#define BANDIT_SWITCH_REWARDS 0
+#define BANDIT_SWITCH_TRIALS  1
+
+// Audio cue types played on BUZZER by the audio timer
+#define AUDIO_SILENCE    0
+#define AUDIO_TONE       1
+#define AUDIO_SWEEP      2
+#define AUDIO_WHITE      3
+#define AUDIO_PINK       4
+
+// Raw MPR121 capture: where the samples go, and the register block of one sample
+#define RAW_TO_FILE      0
+#define RAW_TO_USB       1
+#define MPR121_RAW_BYTES 43      //0x00..0x2A: touch/OOR status, 13 filtered values, 13 baselines
+
+// Inter-lick interval histogram: ILI_BINS-1 bins of ILI_BIN_MS, the last one collects the rest
+#define ILI_BIN_MS       25
+#define ILI_BINS         41
+
+// Lick logging modes for setLickLogging()
+#define LICK_LOG_ROWS    0                  //a logdata() row per lick
+#define LICK_LOG_BOUTS   1                  //a row per bout, lick times to the binary .LCK file
+
+// NeoPixel effects run by serviceLEDs()
+#define LED_EFFECT_NONE  0
+#define LED_EFFECT_WIPE  1
+#define LED_EFFECT_BLINK 2
+#define LED_EFFECT_CUE   3
 static constexpr int STEPS = 200; // number of steps per revolution for the stepper motors
 
 
@@ -99,12 +188,100 @@ class FED3 {
     public:
         FED3(void);
         FED3(String sketch);
+
+        struct Behaviour {
+            uint16_t line = 0;        //where the behaviour resumes, 0 starts from the top
+            bool armed = false;       //the current await has started
+            unsigned long since = 0;  //millis() when it started
+            bool result = false;      //outcome of the last await, false if it timed out
+            uint8_t side = SIDE_LEFT; //side that answered waitPoke()/waitLick()
+        };
+
+        // Per-channel state.  Everything that used to be duplicated as Left/Right lives here and is
+        // indexed by channel; the Left/Right members below are aliases of channels 0 and 1
+        struct Channel {
+            char name[8] = "";               //event prefix: Left, Right, Ch3 ...
+            ChannelPins pins = {0xFF, 0xFF, {0xFF, 0xFF, 0xFF, 0xFF}, 0};
+            volatile bool poked = false;     //poke entry waiting for the sketch
+            volatile bool lickFlag = false;  //lick onset waiting for the sketch or waitLick()
+            int pokes = 0;
+            int delivers = 0;
+            uint32_t licks = 0;
+            bool dropAvailable = false;      //the well has a drop
+            unsigned long dropTime = 0;
+            int doseSteps = 1000;            //steps per dose
+            int motorTurns = 0;
+            uint64_t pokeTime = 0;           //clockMicros() of the last poke entry
+            int interval = 0;                //ms the last poke lasted
+            uint32_t intervalMicros = 0;
+            bool held = false;               //beam currently broken
+            bool logPending = false;         //logPoke() waits for the beam to clear
+            bool inTimeout = false;          //current poke started during a timeout
+        };
+        Channel channel[TB_CHANNELS];
+        void setChannelPins(uint8_t ch, const ChannelPins &pins);
+        void initChannels();
+        bool waitPoke(Behaviour &b, uint8_t side = SIDE_ANY, uint32_t timeoutMs = 0);
+        bool waitLick(Behaviour &b, uint8_t side = SIDE_ANY, uint32_t timeoutMs = 0);
+        bool wait(Behaviour &b, uint32_t ms);
+        bool dispense(Behaviour &b, uint8_t side, int steps = 0);
+
+        // Progressive-ratio engine, one state per side
+        void startPR(uint8_t side, uint8_t series = PR_SERIES_RR, uint16_t step = 1);
+        void stopPR(uint8_t side);
+        bool prResponse(uint8_t side);
+        uint32_t prRequirement(uint8_t side);
+        uint32_t prLastCompleted(uint8_t side);
+        void servicePR();
+        uint32_t prBreakpointTimeout = 3600000UL;  //ms without an active response that marks the breakpoint
+
+        // Seeded PCG32 generator for everything a session randomizes, so runs can be replayed
+        void seedRandom(uint64_t seed);
+        uint32_t randomNumber();
+        uint32_t randomNumber(uint32_t n);
+        uint64_t rngSeed = 0;   //set before begin() to replay a session, 0 draws a fresh seed; logged as RandomSeed
+
+        // Two-armed bandit
+        void startBandit(uint8_t probLeft, uint8_t probRight, uint16_t switchEvery = 30, uint8_t switchOn = BANDIT_SWITCH_REWARDS);
+        void stopBandit();
+        bool banditResponse(uint8_t side);
+        bool banditSession();
+        bool banditActive = false;
+        uint8_t banditSwitchOn = BANDIT_SWITCH_REWARDS;
+        int banditTrials = 0;           //trials in the current block
+
+        // Schedule file: a paradigm described on the SD card instead of in the sketch
+        bool loadSchedule(const char *path = "SCHEDULE.TXT");
+        void runSchedule();
+        void schedulePoke(uint8_t side);
+        void scheduleResponse(uint8_t side);
+        void scheduleReward(uint8_t side);
+        void nextRequirement();
+        bool scheduleLoaded = false;
+        char scheduleRule[32] = "";     //rule line as written in the file, for the log
         String sketch = "undef";
         String sessiontype = "undef";
 
         void classInterruptHandler(void);
         void begin();
         void run();
+
+        // Cooperative scheduler: periodic tasks, one-shot timers and deferred callbacks run from run()
+        typedef void (*TaskFunction)(void *arg);
+        int8_t every(uint32_t periodMs, TaskFunction fn, void *arg = nullptr, const char *name = "task");
+        int8_t after(uint32_t delayMs, TaskFunction fn, void *arg = nullptr, const char *name = "after");
+        int8_t defer(TaskFunction fn, void *arg = nullptr, const char *name = "defer");
+        void cancelTask(int8_t id);
+        void setTaskPeriod(int8_t id, uint32_t periodMs);
+        void runTasks();
+        void startTasks();
+        void printTaskStats(Print &out);
+        int8_t displayTask = -1;
+        int8_t batteryTask = -1;
+        int8_t environmentTask = -1;
+        int8_t logTask = -1;
+        int8_t thresholdTask = -1;
+        int8_t boutTask = -1;
         
         // SD logging
         SdFat SD;
@@ -115,6 +292,7 @@ class FED3 {
         FsFile stopfile;      // Create another file object
         char filename[22];  // Array for file name data logged to named in setup
         void logdata();
+        uint64_t eventTime = 0;     //clockMicros() when the event being logged happened, 0 logs it at the current time
         void CreateFile();
         void CreateDataFile ();
         void writeHeader();
@@ -124,9 +302,34 @@ class FED3 {
         void getFilename(char *filename);
         bool suppressSDerrors = false;  //set to true to suppress SD card errors at startup 
 
-        // Battery
+        // Journaled writes
+        bool openLogFile(bool restartCard = false);
+        bool writeRecord(const char* data, size_t len);
+        void syncLog();
+        int32_t recoverLogFile(const char *name);
+        uint32_t logSeq = 0;                 //sequence number of the last record written to this file
+        uint32_t logRecordsTruncated = 0;    //records cut short to fit LOG_RECORD_SIZE
+        unsigned long logSyncInterval = 1000; //ms between syncs of buffered records, 0 syncs every record
+        unsigned long lastLogSync = 0;
+        bool logDirty = false;
+
+        // Event store for SD outages (PSRAM on Teensy 4.1, DMAMEM otherwise)
+        void eventStoreBegin();
+        void storeRecord(const char* data, size_t len);
+        void drainEventStore();
+        uint32_t eventStoreRecords = 0;       //records waiting for the card
+        uint32_t eventStoreBuffered = 0;      //records that went through the store this session
+        uint32_t eventStoreLost = 0;          //records dropped because the store was full
+        unsigned long sdRetryInterval = 2000; //ms between attempts to reopen the card, doubled per failed attempt
+        unsigned long sdRetryDelay = 2000;    //current backoff, back to sdRetryInterval once the card works
+        unsigned long lastSDRetry = 0;
+
+        // Battery and environment, sampled by the scheduler
         float measuredvbat = 1.0;
         void ReadBatteryLevel();
+        void readEnvironment();
+        float temperature = NAN;       //°C from the AHT20
+        float humidity = NAN;          //%RH from the AHT20
 
         // Neopixel
         void pixelsOn(int R, int G, int B, int W);
@@ -137,6 +340,23 @@ class FED3 {
         void rightPixel(int R, int G, int B, int W);
         void leftPokePixel(int R, int G, int B, int W);
         void rightPokePixel(int R, int G, int B, int W);
+        void setPixels(uint16_t first, uint16_t count, uint32_t c, uint8_t drivers);
+        void showLEDs(bool wait = true);
+        void serviceLEDs();
+        void startColorWipe(uint32_t c, uint16_t wait);
+        void startBlink(uint32_t c, uint16_t onMs, uint16_t offMs, uint16_t blinks);
+        void cueLight(uint32_t c, uint32_t durationMs);
+        void stopLEDEffect();
+        bool ledEffectActive();
+        bool ledDirty = false;         //framebuffer differs from the strip
+        uint8_t ledDrivers = 0;        //drivers the lit pixels need powered
+
+        // Motor driver / NeoPixel power
+        void claimDriverPower(uint8_t drivers, uint8_t user);
+        void releaseDriverPower(uint8_t drivers, uint8_t user);
+        bool driverPowerSettled(uint8_t drivers);
+        uint8_t driverPowerUsers[2] = {0, 0};
+        uint32_t driverPowerOnMicros[2] = {0, 0};
         
         // Display functions
         void UpdateDisplay();
@@ -164,13 +384,18 @@ class FED3 {
         //BNC input/output
 		void ReadBNC(bool blinkGreen);
         bool BNCinput = false;
+        void setBNCMode(uint8_t mode);
+        void bncEdge();
+        void serviceBNC();
+        uint8_t bncMode = BNC_MODE_OUTPUT;
+        uint32_t bncEdgesLost = 0;
         
         // Motor
         void ReleaseMotor();
-        int numMotorTurnsLeft = 0;
-        int numMotorTurnsRight = 0;
-        int doseLeftSteps = 1000;
-        int doseRightSteps = 1000;
+        int &numMotorTurnsLeft = channel[SIDE_LEFT].motorTurns;
+        int &numMotorTurnsRight = channel[SIDE_RIGHT].motorTurns;
+        int &doseLeftSteps = channel[SIDE_LEFT].doseSteps;
+        int &doseRightSteps = channel[SIDE_RIGHT].doseSteps;
         int dispenseRPM = 180;
 
         // Set FED
@@ -183,14 +408,56 @@ class FED3 {
         void Noise(int duration = 200);
         void BNC(int DELAY_MS, int loops);
         void pulseGenerator(int pulse_width, int frequency, int repetitions);
+        bool startPulseTrain(uint32_t widthMicros, uint32_t periodMicros, uint32_t pulses, uint32_t bursts = 1, uint32_t burstPeriodMicros = 0);
+        bool startPulsePattern(const uint32_t *durations, uint8_t count, uint32_t repeats = 1);
+        void stopPulseTrain();
+        void endPulseTrain();
+        bool pulseTrainActive();
+        void startPulseSegment(uint32_t micros);
+        void pulseTrainTick();
+        IntervalTimer pulseTimer;
+        bool pulseTrainLED = true;   //mirror BNC pulses on the green LED
+        uint64_t pulseTrainStartTime = 0;    //clockMicros() of the first rising edge of the current train
+
+        // Sync pulses and barcodes on BNC_OUT
+        void startSync(uint8_t mode = SYNC_BARCODE, uint32_t intervalMs = 5000);
+        void stopSync();
+        void serviceSync();
+        uint8_t syncMode = SYNC_OFF;
+        uint32_t syncInterval = 5000;        //ms between sync pulses/barcodes
+        uint32_t syncBitMicros = 10000;      //pulse width (SYNC_PULSE) or bit width (SYNC_BARCODE)
+        uint32_t syncCount = 0;              //value of the next barcode
+        unsigned long lastSync = 0;
 
         void Tone(int freq, int duration);
         void stopTone();
+
+        // Audio cue sequencer
+        bool playTone(uint16_t freq, uint32_t durationMs);
+        bool playSweep(uint16_t fromFreq, uint16_t toFreq, uint32_t durationMs);
+        bool playNoise(uint32_t durationMs, bool pink = false);
+        bool playSilence(uint32_t durationMs);
+        bool queueAudio(uint8_t type, uint16_t freq, uint16_t toFreq, uint32_t durationMs);
+        void stopAudio();
+        bool audioBusy();
+        void audioTick();
+        uint8_t audioVolume = 255;           //PWM duty of the loudest sample
+        uint32_t audioCuesDropped = 0;       //cues refused because the queue was full
         
         // Pelet and poke functions
         void CheckRatio();
+        void logPoke(uint8_t ch);
+        void finishPoke(uint8_t ch);
+        void logLick(uint8_t ch);
+        int8_t pokeEventChannel();
+        void Feed(uint8_t ch, int steps = 0, int pulse = 0, bool pixelsoff = true);
         void logLeftPoke();
         void logRightPoke();
+        void servicePokes();
+        void pokeEdge(uint8_t side);
+        void pokeDebounce();
+        IntervalTimer pokeTimer;
+        uint32_t pokeDebounceMicros = 2000;   //a poke edge must be stable this long to count
         void serviceLicks();
         void logLeftLick();
         void logRightLick();
@@ -202,7 +469,41 @@ class FED3 {
         void rightTrigger();
         void goToSleep();
 
+        // Watchdog and hang diagnostics
+        void watchdogBegin(uint8_t seconds = 16);
+        void watchdogFeed();
+        void watchdogService();
+        uint8_t enterSection(uint8_t section);
+        void heartbeat(uint8_t subsystem);
+        void watchHeartbeat(uint8_t subsystem, uint32_t maxAgeMs);
+        bool heartbeatsFresh();
+        void logResetDiagnostics();
+        void printMemoryMap(Print &out);
+        uint8_t watchdogTimeout = 16;     //seconds without a feed before the WDOG1 resets the Teensy
+        bool watchdogReset = false;       //true if the last reset was caused by the watchdog
+        uint32_t heartbeatMaxAge[NUM_SECTIONS] = {0};  //ms a watched subsystem may go without a heartbeat, 0 unwatched
+        unsigned long lastRunMicros = 0;
+
+        // Timebase: one monotonic µs clock for every event, wall time disciplined to the RTC
+        void syncWallClock();
+        uint64_t clockMicros();
+        uint64_t wallMicros();
+        void serviceClock();
+        uint32_t clockDisciplineInterval = 10000;  //ms between comparisons with the RTC
+        unsigned long lastClockDiscipline = 0;
+        int32_t clockError = 0;                    //RTC minus wall time at the last comparison, µs
+
         void Timeout(int timeout, bool reset = false, bool whitenoise = false);
+        void startTimeout(int seconds, bool reset = false, bool whitenoise = false);
+        bool inTimeout();
+        void timeoutPoke(uint8_t side);
+        void serviceTimeout();
+        void serviceEvents();
+        bool timeoutActive = false;
+        bool timeoutReset = false;
+        bool timeoutWhiteNoise = false;
+        unsigned long timeoutStart = 0;
+        unsigned long timeoutLength = 0;
 
 
         int minPokeTime = 0;
@@ -210,8 +511,14 @@ class FED3 {
         int consecutive = 0;
         
         //jam movements
+        bool RotateDisk(uint8_t ch, int steps);
 		bool RotateDiskLeft(int steps);
         bool RotateDiskRight(int steps);
+        bool startRotate(uint8_t side, int steps);
+        bool motorBusy(uint8_t side);
+        void motorTick();
+        void finishFeed(uint8_t side, int pulse);
+        IntervalTimer motorTimer;
         //bool ClearJam();
         //bool VibrateJam();
         //bool MinorJam();
@@ -229,11 +536,11 @@ class FED3 {
         byte previousFEDmode = FEDmode;
   
         // event counters
-        int LeftCount = 0;
-        int RightCount = 0;
+        int &LeftCount = channel[SIDE_LEFT].pokes;
+        int &RightCount = channel[SIDE_RIGHT].pokes;
         int TotalDeliverCount = 0;
-        int LeftDeliverCount = 0;
-        int RightDeliverCount = 0;
+        int &LeftDeliverCount = channel[SIDE_LEFT].delivers;
+        int &RightDeliverCount = channel[SIDE_RIGHT].delivers;
         int BlockPelletCount = 0;
         int timeout = 0;
 
@@ -241,10 +548,10 @@ class FED3 {
         
         // state variables
         bool activePoke = 1;  // 0 for right, 1 for left, defaults to left poke active
-        volatile bool Left = false;
-        volatile bool Right = false;
-        bool LeftDropAvailable = false; //left pellet well has a drop
-        bool RightDropAvailable = false; //right pellet well has a drop
+        volatile bool &Left = channel[SIDE_LEFT].poked;
+        volatile bool &Right = channel[SIDE_RIGHT].poked;
+        bool &LeftDropAvailable = channel[SIDE_LEFT].dropAvailable; //left pellet well has a drop
+        bool &RightDropAvailable = channel[SIDE_RIGHT].dropAvailable; //right pellet well has a drop
         unsigned long currentHour;
         unsigned long currentMinute;
         unsigned long currentSecond;
@@ -259,15 +566,17 @@ class FED3 {
 
         // timing variables
         int retInterval = 0;
-        int leftInterval = 0;
-        int rightInterval = 0;
-        int leftPokeTime = 0.0;
-        int rightPokeTime = 0.0;
-        unsigned long LeftDropTime = 0;
-        unsigned long RightDropTime = 0;
-        unsigned long lastPellet = 0;
+        int &leftInterval = channel[SIDE_LEFT].interval;           //ms
+        int &rightInterval = channel[SIDE_RIGHT].interval;
+        uint32_t &leftIntervalMicros = channel[SIDE_LEFT].intervalMicros;
+        uint32_t &rightIntervalMicros = channel[SIDE_RIGHT].intervalMicros;
+        uint64_t &leftPokeTime = channel[SIDE_LEFT].pokeTime;      //clockMicros() of the last poke entry
+        uint64_t &rightPokeTime = channel[SIDE_RIGHT].pokeTime;
+        unsigned long &LeftDropTime = channel[SIDE_LEFT].dropTime;
+        unsigned long &RightDropTime = channel[SIDE_RIGHT].dropTime;
+        uint64_t lastPellet = 0;        //clockMicros() of the last pellet
         unsigned long unixtime = 0;
-        int interPelletInterval = 0;
+        double interPelletInterval = 0; //seconds
 
         // flags
         bool Ratio_Met = false;
@@ -278,10 +587,8 @@ class FED3 {
         bool FED3Menu = false;
         bool psygene = false;
         bool tempSensor = false;
-        volatile bool lickLeftFlag;
-        volatile bool lickRightFlag;
-        volatile bool leftHeld = false;
-        volatile bool rightHeld = false;
+        volatile bool &lickLeftFlag = channel[SIDE_LEFT].lickFlag;
+        volatile bool &lickRightFlag = channel[SIDE_RIGHT].lickFlag;
 
         int EndTime = 0;
         int ratio = 1;
@@ -291,6 +598,7 @@ class FED3 {
         bool SetFED = false;
         bool setTimed = false;
         
+        // Peripheral drivers stay members when TBConfig disables them; they are then never begun
         // Neopixel strip
         Adafruit_NeoPixel strip = Adafruit_NeoPixel(10, NEOPIXEL, NEO_GRBW + NEO_KHZ800);
         // Display
@@ -303,8 +611,65 @@ class FED3 {
         // MPR121 Touch Sensor
         Adafruit_MPR121 cap;
         volatile bool lickIRQ = false;
-        uint32_t LeftLickCount = 0;
-        uint32_t RightLickCount = 0;
+        volatile uint64_t lickIRQTime = 0;
+        void lickInterrupt();
+        // Interrupt-driven MPR121 reads on Wire2; the callback runs in the I2C interrupt
+        typedef void (*I2CCallback)(void *arg, bool ok);
+        bool mprReadAsync(uint8_t reg, uint8_t *buf, uint8_t len, I2CCallback cb, void *arg);
+        void mprAcquire();
+        void mprRelease();
+        void serviceMprBus();
+        uint32_t mprReadErrors = 0;          //async reads that ended in a NACK or bus error
+        uint32_t mprBusResets = 0;           //transfers that overran MPR_TRANSFER_TIMEOUT and reset LPI2C4
+
+        // Adaptive lick thresholds: per-electrode noise and touch depth are tracked from the
+        // filtered data, and thresholds that drift are rewritten and logged
+        void startAdaptiveThresholds(uint32_t periodMs = 1000);
+        void stopAdaptiveThresholds();
+        void serviceThresholds();
+        void adaptThresholds();
+        void setElectrodeThresholds(uint8_t electrode, uint8_t touch, uint8_t release);
+        void recalibrateElectrodes();
+        uint8_t touchThreshold[12];
+        uint8_t releaseThreshold[12];
+        uint32_t stuckTouchMs = 60000;       //a touch this long marks the electrode stuck and recalibrates
+
+        // Lick microstructure: bouts end at an ILI of boutILIMs or more; counts, means and the
+        // ILI histogram are kept per channel in fixed memory and written to a _BOUTS.CSV sidecar
+        void boutLick(uint8_t ch, uint64_t time);
+        void closeBouts();
+        void endBout(uint8_t ch);
+        bool setLickLogging(uint8_t mode);
+        void flushLickTimes();
+        void bufferLickStamp(uint64_t value, uint8_t ch);
+        void writeLickOffset();
+        uint32_t boutCount(uint8_t ch);
+        float meanBoutLicks(uint8_t ch);
+        float meanBoutDuration(uint8_t ch);  //s
+        float meanILI(uint8_t ch);           //ms, within bouts
+        uint32_t iliHistogram(uint8_t ch, uint8_t bin);
+        void writeBoutSummary();
+        uint32_t boutILIMs = 500;
+        uint8_t boutMinLicks = 1;            //shorter runs of licks are not counted as bouts
+        uint32_t boutSummaryInterval = 600000;  //ms between summary rows, 0 writes none
+        uint8_t lickLogMode = LICK_LOG_ROWS;
+        int8_t boutCloseTask = -1;
+        uint32_t lickTimesWritten = 0;       //lick records in the .LCK file
+        FsFile lickfile;
+        bool lickTTL(uint16_t touched, uint64_t irqTime);
+        void printLickTTLLatency(Print &out);
+        void logLickTTLLatency();
+        uint16_t lickTTLMask = 0;            //electrodes whose lick onset fires BNC_OUT directly, 0 disables the fast path
+        uint32_t lickTTLWidthMicros = 1000;  //width of the lick-triggered TTL pulse
+        bool startRawCapture(uint8_t dest = RAW_TO_FILE, uint32_t intervalMicros = 1250);
+        void stopRawCapture();
+        void serviceRawCapture();
+        bool rawCaptureActive = false;
+        volatile uint32_t rawSamples = 0;    //samples read since startRawCapture()
+        volatile uint32_t rawSamplesDropped = 0;  //samples lost because the queue was full
+        FsFile rawfile;
+        uint32_t &LeftLickCount = channel[SIDE_LEFT].licks;
+        uint32_t &RightLickCount = channel[SIDE_RIGHT].licks;
 
     private:
         static FED3* staticFED;
@@ -0,0 +1,130 @@
+/*
+  TwoBottle board configuration
+  -----------------------------
+  Pin map, channel count and optional peripherals of the rig, fixed at compile time.
+  Override any value with a build flag (-DTB_HAS_DISPLAY=0), or point TB_CONFIG_HEADER
+  at a board file that defines the values it changes, e.g.
+
+      -DTB_CONFIG_HEADER=\"MyRig.h\"
+
+  A disabled peripheral is never set up, gets no task, and its drawing and LED code is
+  discarded by if constexpr, so the hot paths carry no runtime check for it.  Its driver
+  object stays a member of FED3, constructed but never begun, so sketches that touch it
+  still compile.
+*/
+
+#ifndef TWOBOTTLE_CONFIG_H
+#define TWOBOTTLE_CONFIG_H
+
+#ifdef TB_CONFIG_HEADER
+#include TB_CONFIG_HEADER
+#endif
+
+// Optional peripherals, 1 builds support in, 0 compiles it out
+#ifndef TB_HAS_DISPLAY
+#define TB_HAS_DISPLAY   1      //Sharp memory display
+#endif
+#ifndef TB_HAS_AHT20
+#define TB_HAS_AHT20     1      //temperature/humidity sensor, logged when found at boot
+#endif
+#ifndef TB_HAS_NEOPIXELS
+#define TB_HAS_NEOPIXELS 1      //cue light strip
+#endif
+#ifndef TB_HAS_MENU
+#define TB_HAS_MENU      1      //mode, device number and clock menus (needs the display)
+#endif
+
+// Spout channels, see ChannelPins in TwoBottle.h
+#ifndef TB_CHANNELS
+#define TB_CHANNELS      2
+#endif
+
+// Pin definitions
+#ifndef NEOPIXEL
+#define NEOPIXEL        18
+#endif
+#ifndef MOTOR_ENABLE_LEFT
+#define MOTOR_ENABLE_LEFT    15
+#endif
+#define MOTOR_ENABLE MOTOR_ENABLE_LEFT // alias for functions still calling motor_enable
+#ifndef MOTOR_ENABLE_RIGHT
+#define MOTOR_ENABLE_RIGHT   35
+#endif
+#ifndef GREEN_LED
+#define GREEN_LED       30
+#endif
+#ifndef LEFT_POKE
+#define LEFT_POKE       22
+#endif
+#ifndef RIGHT_POKE
+#define RIGHT_POKE      21
+#endif
+#ifndef BUZZER
+#define BUZZER          3
+#endif
+#ifndef VBATPIN
+#define VBATPIN         A6
+#endif
+#ifndef BNC_OUT
+#define BNC_OUT         23
+#endif
+#ifndef SHARP_SCK
+#define SHARP_SCK       12
+#endif
+#ifndef SHARP_MOSI
+#define SHARP_MOSI      11
+#endif
+#ifndef SHARP_SS
+#define SHARP_SS        10
+#endif
+#ifndef MPR121_SDA
+#define MPR121_SDA     25
+#endif
+#ifndef MPR121_SCL
+#define MPR121_SCL     24
+#endif
+#ifndef MPR121_IRQ
+#define MPR121_IRQ     9
+#endif
+#ifndef MPR121_ADDR
+#define MPR121_ADDR    0x5A
+#endif
+#ifndef LEFT_LICK
+#define LEFT_LICK 0
+#endif
+#ifndef RIGHT_LICK
+#define RIGHT_LICK 1
+#endif
+
+#ifndef L_IN1
+#define L_IN1 16
+#define L_IN2 17
+#define L_IN3 14
+#define L_IN4 13
+#endif
+#ifndef R_IN1
+#define R_IN1 36
+#define R_IN2 37
+#define R_IN3 34
+#define R_IN4 33
+#endif
+
+// The same settings as compile-time traits.  Library code tests them with if constexpr
+struct TwoBottleConfig {
+  static constexpr bool display   = TB_HAS_DISPLAY;
+  static constexpr bool aht20     = TB_HAS_AHT20;
+  static constexpr bool neopixels = TB_HAS_NEOPIXELS;
+  static constexpr bool menu      = TB_HAS_MENU && TB_HAS_DISPLAY;
+  static constexpr uint8_t channels = TB_CHANNELS;
+};
+
+// A board file may supply its own traits type with the same members
+#ifndef TB_CONFIG
+#define TB_CONFIG TwoBottleConfig
+#endif
+typedef TB_CONFIG TBConfig;
+
+// Arrays are sized by TB_CHANNELS, loops and checks by the traits: a board traits type must agree
+static_assert(TBConfig::channels == TB_CHANNELS, "TBConfig::channels must equal TB_CHANNELS");
+
+#endif